@@ -3,14 +3,171 @@
 int fightsSimulatedDefault;
 int * totalFightsSimulated = &fightsSimulatedDefault;
 
-// Prototype function! Currently not used. Function determining if a monster is strictly better than another
-bool isBetter(Monster * a, Monster * b, bool considerAbilities) {
-    if (a->element == b->element) {
-        return (a->damage >= b->damage) && (a->hp >= b->hp);
-    } else { // a needs to be better than b even when b has elemental advantage, or a is at disadvantage
-        return !considerAbilities && (a->damage >= (int16_t) ((double) b->damage * elementalBoost)) && (a->hp >= (int16_t) ((double) b->hp * elementalBoost));
+// Damage attacker deals to defender in a fight without skills
+static int getElementalDamage(const Monster & attacker, const Monster & defender) {
+    if (counter[defender.element] == attacker.element) {
+        return castCeil((double) attacker.damage * elementalBoost);
     }
+    return attacker.damage;
 }
 
-ArmyCondition leftCondition;
-ArmyCondition rightCondition;
+// Function determining if monster a is at least as good as monster b against every monster of a target without skills
+bool isBetter(const Monster & a, const Monster & b, const Army & target) {
+    if (a.hp < b.hp) {
+        return false;
+    }
+    for (int i = 0; i < target.monsterAmount; i++) {
+        const Monster & enemy = monsterReference[target.monsters[i]];
+        if (getElementalDamage(a, enemy) < getElementalDamage(b, enemy) || getElementalDamage(enemy, a) > getElementalDamage(enemy, b)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+SnapshotStore::SnapshotStore() :
+    blockAmount(0),
+    used(0)
+{}
+
+SnapshotStore::~SnapshotStore() {
+    this->setCapacity(0);
+}
+
+void SnapshotStore::setCapacity(const size_t bytes) {
+    for (size_t i = 0; i < this->blockAmount; i++) {
+        delete[] this->blocks[i].load();
+    }
+    // Indices have to stay below the values of Army::snapshot with a special meaning
+    this->blockAmount = std::min(bytes / (BLOCK_SIZE * sizeof(FightSnapshot)), (size_t) MISSING_SNAPSHOT / BLOCK_SIZE);
+    this->blocks.reset(this->blockAmount > 0 ? new std::atomic<FightSnapshot *>[this->blockAmount] : nullptr);
+    for (size_t i = 0; i < this->blockAmount; i++) {
+        this->blocks[i].store(nullptr);
+    }
+    this->used = 0;
+}
+
+void SnapshotStore::clear() {
+    this->used = 0;
+}
+
+uint32_t SnapshotStore::add(const FightSnapshot & snapshot) {
+    const size_t index = this->used.fetch_add(1, std::memory_order_relaxed);
+    if (index >= this->blockAmount * BLOCK_SIZE) {
+        return MISSING_SNAPSHOT;
+    }
+    std::atomic<FightSnapshot *> & block = this->blocks[index / BLOCK_SIZE];
+    FightSnapshot * snapshots = block.load(std::memory_order_acquire);
+    if (snapshots == nullptr) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        snapshots = block.load(std::memory_order_acquire);
+        if (snapshots == nullptr) {
+            snapshots = new FightSnapshot[BLOCK_SIZE];
+            block.store(snapshots, std::memory_order_release);
+        }
+    }
+    snapshots[index % BLOCK_SIZE] = snapshot;
+    return (uint32_t) index;
+}
+
+SuffixMemo::SuffixMemo() :
+    setMask(0),
+    generation(1)
+{}
+
+void SuffixMemo::setCapacity(const size_t bytes) {
+    if (bytes < sizeof(Set)) {
+        this->sets.reset();
+        this->setMask = 0;
+        return;
+    }
+    // The amount of sets is a power of 2, so a set can be picked with a mask
+    size_t setAmount = 1;
+    while (setAmount * 2 * sizeof(Set) <= bytes) {
+        setAmount *= 2;
+    }
+    if (this->isEnabled() && this->setMask == setAmount - 1) {
+        return;
+    }
+    this->sets.reset(new Set[setAmount]);
+    this->setMask = setAmount - 1;
+    for (size_t i = 0; i < setAmount; i++) {
+        this->sets[i].lock.clear();
+        this->sets[i].clock = 0;
+        for (int k = 0; k < WAYS; k++) {
+            this->sets[i].entries[k].generation = 0;
+        }
+    }
+    this->generation = 1;
+}
+
+inline SuffixMemo::Set * SuffixMemo::getSet(const FightResult & start, const MonsterIndex monster) {
+    return &this->sets[(hashResumeState(start, monster) >> 24) & this->setMask];
+}
+
+bool SuffixMemo::find(const FightResult & start, const MonsterIndex monster, FightResult & end, bool & leftWins) {
+    Set * set = this->getSet(start, monster);
+    bool found = false;
+    while (set->lock.test_and_set(std::memory_order_acquire)) {}
+    for (int k = 0; k < WAYS; k++) {
+        Entry & entry = set->entries[k];
+        if (entry.generation == this->generation && entry.monster == monster && isSameResumeState(entry.start, start)) {
+            entry.lastUse = ++set->clock;
+            end = entry.end;
+            leftWins = entry.leftWins;
+            found = true;
+            break;
+        }
+    }
+    set->lock.clear(std::memory_order_release);
+    return found;
+}
+
+void SuffixMemo::insert(const FightResult & start, const MonsterIndex monster, const FightResult & end, const bool leftWins) {
+    Set * set = this->getSet(start, monster);
+    while (set->lock.test_and_set(std::memory_order_acquire)) {}
+    int victim = 0;
+    for (int k = 0; k < WAYS; k++) {
+        const Entry & entry = set->entries[k];
+        if (entry.generation != this->generation) {
+            victim = k;
+            break;
+        }
+        if (entry.lastUse < set->entries[victim].lastUse) {
+            victim = k;
+        }
+    }
+    Entry & entry = set->entries[victim];
+    entry.start = start;
+    entry.end = end;
+    entry.monster = monster;
+    entry.leftWins = leftWins;
+    entry.generation = this->generation;
+    entry.lastUse = ++set->clock;
+    set->lock.clear(std::memory_order_release);
+}
+
+FightContext defaultFightContext;
+
+FightFunction fightFunctions[FIGHT_ALL + 1];
+
+// Every feature but FIGHT_SKILLS comes from a skill, masks with other features but without it use the kernel with skills
+template <unsigned Mask>
+struct FightKernel {
+    static const unsigned features = (Mask == 0 || (Mask & FIGHT_SKILLS)) ? Mask : (Mask | FIGHT_SKILLS);
+};
+
+// Fills fightFunctions from Mask down to 0
+template <unsigned Mask>
+bool fillFightFunctions() {
+    fightFunctions[Mask] = &simulateFight<FightKernel<Mask>::features>;
+    return fillFightFunctions<Mask - 1>();
+}
+
+template <>
+bool fillFightFunctions<0>() {
+    fightFunctions[0] = &simulateFight<0>;
+    return true;
+}
+
+static const bool fightFunctionsFilled = fillFightFunctions<FIGHT_ALL>();
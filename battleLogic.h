@@ -3,6 +3,11 @@
 
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <type_traits>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 #include "cosmosData.h"
 
@@ -11,6 +16,13 @@ extern int fightsSimulatedDefault;
 
 const int VALID_RAINBOW_CONDITION = 15; // Binary 00001111 -> means all elements were added
 
+// Integer type of all health values in a fight. Only worldbosses have more health than fits into 32 bits
+template <unsigned Features>
+using FightHealth = typename std::conditional<(Features & FIGHT_WORLDBOSS) != 0, int64_t, int32_t>::type;
+
+// Attacks are capped to this in fights with 32 bit health. Every monster has less health, so the capped attack kills just the same
+const int64_t NARROW_DAMAGE_LIMIT = std::numeric_limits<int32_t>::max() / 2;
+
 // Struct keeping track of everything that is only valid for one turn
 struct TurnData {
     int64_t baseDamage = 0;
@@ -37,12 +49,13 @@ struct TurnData {
 };
 
 // Keep track of an army's condition during a fight and save some convenience data
+template <class Health>
 class ArmyCondition {
     public:
         int armySize;
         Monster * lineup[ARMY_MAX_SIZE];
-        int64_t remainingHealths[ARMY_MAX_SIZE];
-        int64_t maxHealths[ARMY_MAX_SIZE];
+        Health remainingHealths[ARMY_MAX_SIZE];
+        Health maxHealths[ARMY_MAX_SIZE];
         SkillType skillTypes[ARMY_MAX_SIZE];
         Element skillTargets[ARMY_MAX_SIZE];
         double skillAmounts[ARMY_MAX_SIZE];
@@ -61,18 +74,24 @@ class ArmyCondition {
 
         bool worldboss;
 
+        const TargetProfile * profile;  // Precompiled data of this army if it is the target, nullptr otherwise
+        bool skillsLost;                // True if a monster behind the frontliner died. The profile's skill totals are invalid then
+
         TurnData turnData;
 
         inline void init(const Army & army, const int oldMonstersLost, const int aoeDamage);
         inline void afterDeath();
-        inline void startNewTurn();
-        inline void getDamage(const int turncounter, const ArmyCondition & opposingCondition);
-        inline void resolveDamage(TurnData & opposing);
+        template <unsigned Features> inline void startNewTurn();
+        template <unsigned Features> inline void getDamage(const int turncounter, const ArmyCondition & opposingCondition);
+        template <unsigned Features> inline void resolveDamage(TurnData & opposing);
+        inline int64_t getTurnSeed(const int turncounter) const;
+        inline bool isQuiescent() const;
 
 };
 
 // extract and extrapolate all necessary data from an army
-inline void ArmyCondition::init(const Army & army, const int oldMonstersLost, const int aoeDamage) {
+template <class Health>
+inline void ArmyCondition<Health>::init(const Army & army, const int oldMonstersLost, const int aoeDamage) {
     int i;
     HeroSkill * skill;
 
@@ -88,6 +107,10 @@ inline void ArmyCondition::init(const Army & army, const int oldMonstersLost, co
     worldboss = false;
     aoeZero = 0;
 
+    profile = nullptr;
+    skillsLost = false;
+    turnData.healing = 0; // Hawking's aoe in turn zero must not heal with values of a previous fight
+
     for (i = armySize -1; i >= monstersLost; i--) {
         lineup[i] = &monsterReference[army.monsters[i]];
 
@@ -114,9 +137,33 @@ inline void ArmyCondition::init(const Army & army, const int oldMonstersLost, co
 }
 
 // Reset turndata and fill it again with the hero abilities' values
-inline void ArmyCondition::startNewTurn() {
+template <class Health>
+template <unsigned Features>
+inline void ArmyCondition<Health>::startNewTurn() {
     int i;
 
+    if (!(Features & FIGHT_SKILLS)) {
+        turnData.buffDamage = 0;
+        turnData.protection = 0;
+        turnData.aoeDamage = 0;
+        turnData.healing = 0;
+        turnData.dampFactor = 1;
+        turnData.absorbMult = 0;
+        turnData.absorbDamage = 0;
+        return;
+    }
+
+    if (profile != nullptr && !skillsLost) {
+        turnData.buffDamage = profile->buffDamage[monstersLost];
+        turnData.protection = profile->protection[monstersLost];
+        turnData.aoeDamage = profile->aoeDamage[monstersLost];
+        turnData.healing = profile->healing[monstersLost];
+        turnData.dampFactor = profile->dampFactor[monstersLost];
+        turnData.absorbMult = profile->absorbMult[monstersLost];
+        turnData.absorbDamage = 0;
+        return;
+    }
+
     turnData.buffDamage = 0;
     turnData.protection = 0;
     turnData.aoeDamage = 0;
@@ -156,14 +203,15 @@ inline void ArmyCondition::startNewTurn() {
 
 // Handle all self-centered abilites and other multipliers on damage
 // Protection needs to be calculated at this point.
-inline void ArmyCondition::getDamage(const int turncounter, const ArmyCondition & opposingCondition) {
+template <class Health>
+template <unsigned Features>
+inline void ArmyCondition<Health>::getDamage(const int turncounter, const ArmyCondition & opposingCondition) {
     turnData.baseDamage = lineup[monstersLost]->damage; // Get Base damage
 
     const Element opposingElement = opposingCondition.lineup[opposingCondition.monstersLost]->element;
     const int opposingProtection = opposingCondition.turnData.protection;
     const double opposingDampFactor = opposingCondition.turnData.dampFactor;
     const double opposingAbsorbMult = opposingCondition.turnData.absorbMult;
-    const int64_t turnSeed = (opposingCondition.seed + (101 - turncounter)*(101 - turncounter)*(101 - turncounter)) % (int64_t)round((double)opposingCondition.seed / (101 - turncounter) + (101 - turncounter)*(101 - turncounter));
 
     // Handle Monsters with skills that only activate on attack.
     turnData.paoeDamage = 0;
@@ -177,8 +225,7 @@ inline void ArmyCondition::getDamage(const int turncounter, const ArmyCondition
     turnData.counter = 0;
     turnData.target = 0;
 
-
-    switch (skillTypes[monstersLost]) {
+    if (Features & FIGHT_SKILLS) switch (skillTypes[monstersLost]) {
         case FRIENDS:   turnData.multiplier *= (double) pow(skillAmounts[monstersLost], pureMonsters[monstersLost]);
                         break;
         case TRAINING:  turnData.buffDamage += (int) (skillAmounts[monstersLost] * (double) turncounter);
@@ -204,9 +251,9 @@ inline void ArmyCondition::getDamage(const int turncounter, const ArmyCondition
         case DICE:      turnData.baseDamage += opposingCondition.seed % (int)(skillAmounts[monstersLost] + 1); // Only adds dice attack effect if dice is in front, max health is done before battle
                         break;
         // Pick a target, Bubbles currently dampens lux damage if not targeting first according to game code, interaction should be added if this doesn't change
-        case LUX:       turnData.target = turnSeed % (opposingCondition.armySize - opposingCondition.monstersLost);
+        case LUX:       turnData.target = opposingCondition.getTurnSeed(turncounter) % (opposingCondition.armySize - opposingCondition.monstersLost);
                         break;
-        case CRIT:      turnData.critMult *= turnSeed % 2 == 1 ? skillAmounts[monstersLost] : 1;
+        case CRIT:      turnData.critMult *= opposingCondition.getTurnSeed(turncounter) % 2 == 1 ? skillAmounts[monstersLost] : 1;
                         break;
         case HATE:      turnData.hate = skillAmounts[monstersLost];
                         break;
@@ -228,8 +275,12 @@ inline void ArmyCondition::getDamage(const int turncounter, const ArmyCondition
     turnData.valkyrieDamage *= turnData.critMult;
 
     //absorb damage, damage rounded up later
-    turnData.absorbDamage = turnData.valkyrieDamage * opposingAbsorbMult;
-    turnData.valkyrieDamage = turnData.valkyrieDamage - turnData.absorbDamage;
+    if (Features & FIGHT_AOE) {
+        turnData.absorbDamage = turnData.valkyrieDamage * opposingAbsorbMult;
+        turnData.valkyrieDamage = turnData.valkyrieDamage - turnData.absorbDamage;
+    } else {
+        turnData.absorbDamage = 0;
+    }
 
     // for compiling heavyDamage version
     if (turnData.valkyrieDamage >= std::numeric_limits<int>::max())
@@ -237,8 +288,14 @@ inline void ArmyCondition::getDamage(const int turncounter, const ArmyCondition
     else
         turnData.baseDamage = castCeil(turnData.valkyrieDamage);
 
+    // Keep attacks within the range of narrow health values
+    if (sizeof(Health) < sizeof(int64_t) && turnData.baseDamage > NARROW_DAMAGE_LIMIT) {
+        turnData.baseDamage = NARROW_DAMAGE_LIMIT;
+        turnData.valkyrieDamage = (double) NARROW_DAMAGE_LIMIT;
+    }
+
     // Handle enemy dampen ability and reduce aoe effects
-    if (opposingDampFactor < 1) {
+    if ((Features & FIGHT_SKILLS) && opposingDampFactor < 1) {
         turnData.valkyrieDamage *= opposingDampFactor;
         turnData.explodeDamage = castCeil((double) turnData.explodeDamage * opposingDampFactor);
         turnData.aoeDamage = castCeil((double) turnData.aoeDamage * opposingDampFactor);
@@ -248,131 +305,720 @@ inline void ArmyCondition::getDamage(const int turncounter, const ArmyCondition
 }
 
 // Add damage to the opposing side and check for deaths
-inline void ArmyCondition::resolveDamage(TurnData & opposing) {
+template <class Health>
+template <unsigned Features>
+inline void ArmyCondition<Health>::resolveDamage(TurnData & opposing) {
     int i;
     int frontliner = monstersLost; // save original frontliner
+    const bool isWorldboss = (Features & FIGHT_WORLDBOSS) && worldboss;
 
     // Apply normal attack damage to the frontliner
-    remainingHealths[frontliner + opposing.target] -= opposing.baseDamage;
+    if (Features & FIGHT_GAMBLER) {
+        remainingHealths[frontliner + opposing.target] -= opposing.baseDamage;
+    } else {
+        remainingHealths[frontliner] -= opposing.baseDamage;
+    }
 
-    if (opposing.counter && (worldboss || remainingHealths[frontliner] > 0))
+    if ((Features & FIGHT_SKILLS) && opposing.counter && (isWorldboss || remainingHealths[frontliner] > 0))
         remainingHealths[frontliner] -= static_cast<int64_t>(ceil(turnData.baseDamage * opposing.counter));
 
-    if (opposing.trampleTriggered && armySize > frontliner + 1) {
-        remainingHealths[frontliner + 1] -= opposing.valkyrieDamage;
-    }
+    if (Features & FIGHT_AOE) {
+        if (opposing.trampleTriggered && armySize > frontliner + 1) {
+            remainingHealths[frontliner + 1] -= opposing.valkyrieDamage;
+        }
 
-    if (remainingHealths[frontliner] <= 0 && !worldboss) {
-        opposing.aoeDamage += opposing.explodeDamage;
+        if (remainingHealths[frontliner] <= 0 && !isWorldboss) {
+            opposing.aoeDamage += opposing.explodeDamage;
+        }
     }
 
     // Handle aoe Damage for all combatants
     for (i = frontliner; i < armySize; i++) {
-        // handle absorbed damage
-        if (i > frontliner && skillTypes[i] == ABSORB) {
-            remainingHealths[i] -= castCeil(opposing.absorbDamage);
-        }
+        if (Features & FIGHT_AOE) {
+            // handle absorbed damage
+            if (i > frontliner && skillTypes[i] == ABSORB) {
+                remainingHealths[i] -= castCeil(opposing.absorbDamage);
+            }
 
-        remainingHealths[i] -= opposing.aoeDamage;
+            remainingHealths[i] -= opposing.aoeDamage;
 
-        if (i > frontliner) { // Aoe that doesnt affect the frontliner
-            remainingHealths[i] -= opposing.paoeDamage + castCeil(opposing.valkyrieDamage);
-        }
-        if (remainingHealths[i] <= 0 && !worldboss) {
+            if (i > frontliner) { // Aoe that doesnt affect the frontliner
+                remainingHealths[i] -= opposing.paoeDamage + castCeil(opposing.valkyrieDamage);
+            }
+        }
+        if (remainingHealths[i] <= 0 && !isWorldboss) {
             if (i == monstersLost) {
                 monstersLost++;
                 berserkProcs = 0;
+            } else {
+                skillsLost = true;
             }
             skillTypes[i] = NOTHING; // disable dead hero's ability
         } else {
-            remainingHealths[i] += turnData.healing;
+            if (Features & FIGHT_HEAL) {
+                remainingHealths[i] += turnData.healing;
+            }
             if (remainingHealths[i] > maxHealths[i]) { // Avoid overhealing
                 remainingHealths[i] = maxHealths[i];
             }
         }
-        opposing.valkyrieDamage *= opposing.valkyrieMult;
+        if (Features & FIGHT_AOE) {
+            opposing.valkyrieDamage *= opposing.valkyrieMult;
+        }
     }
     // Handle wither ability
-    if (monstersLost == frontliner && skillTypes[monstersLost] == WITHER) {
+    if ((Features & FIGHT_SKILLS) && monstersLost == frontliner && skillTypes[monstersLost] == WITHER) {
         remainingHealths[monstersLost] = castCeil((double) remainingHealths[monstersLost] * skillAmounts[monstersLost]);
     }
 }
 
-extern ArmyCondition leftCondition;
-extern ArmyCondition rightCondition;
+// Check if this army's turn repeats exactly until its frontliner or the opposing one dies.
+// That is the case if nothing but the frontliner's attack happens and the attack doesn't depend on the turn.
+// Must be called after getDamage.
+template <class Health>
+inline bool ArmyCondition<Health>::isQuiescent() const {
+    switch (skillTypes[monstersLost]) {
+        case TRAINING:
+        case BERSERK:
+        case LUX:
+        case CRIT:
+        case WITHER:    return false;
+        default:        break;
+    }
+    if (worldboss || turnData.aoeDamage != 0 || turnData.paoeDamage != 0 || turnData.healing != 0 ||
+        turnData.counter != 0 || turnData.trampleTriggered || turnData.valkyrieMult != 0 || turnData.absorbDamage != 0 ||
+        remainingHealths[monstersLost] > maxHealths[monstersLost]) {
+        return false;
+    }
+    // Dead monsters lose their skill during the next resolveDamage which can change the following turns
+    for (int i = monstersLost + 1; i < armySize; i++) {
+        if (remainingHealths[i] <= 0 && skillTypes[i] != NOTHING) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Skip all turns that are exact repetitions of the current one. Stops right before the turn in which a frontliner dies
+// or the last turn, which are then simulated normally. Must be called after getDamage of both sides.
+template <class Health>
+inline void fastForward(ArmyCondition<Health> & leftCondition, ArmyCondition<Health> & rightCondition, int & turncounter) {
+    const int64_t leftDamage = leftCondition.turnData.baseDamage;
+    const int64_t rightDamage = rightCondition.turnData.baseDamage;
+    Health & leftHealth = leftCondition.remainingHealths[leftCondition.monstersLost];
+    Health & rightHealth = rightCondition.remainingHealths[rightCondition.monstersLost];
+
+    if (leftDamage < 0 || rightDamage < 0) {
+        return;
+    }
+    int64_t turns = TURN_LIMIT - 1 - turncounter;
+    if (rightDamage > 0) {
+        turns = std::min(turns, ((int64_t) leftHealth - 1) / rightDamage);
+    }
+    if (leftDamage > 0) {
+        turns = std::min(turns, ((int64_t) rightHealth - 1) / leftDamage);
+    }
+    if (turns <= 0 || !leftCondition.isQuiescent() || !rightCondition.isQuiescent()) {
+        return;
+    }
+    leftHealth -= turns * rightDamage;
+    rightHealth -= turns * leftDamage;
+    turncounter += (int) turns;
+}
+
+// Detects worldboss fights that settled into a state in which every turn is the same.
+// Worldbosses never die, so without this every fight would be simulated until the turn limit.
+// The state contains everything a turn depends on except the boss' health. If it is the same after two consecutive turns
+// and no active skill depends on the turn or the boss' health, all remaining turns deal the same damage to the boss.
+class SteadyStateDetector {
+    private:
+        int64_t leftHealths[ARMY_MAX_SIZE];
+        SkillType leftSkills[ARMY_MAX_SIZE];
+        int leftMonstersLost = 0;
+        int leftBerserk = 0;
+        int bossBerserk = 0;
+        int64_t bossHealth = 0;
+        bool hasState = false;
+
+    public:
+        int64_t bossHealthChange; // Change of the boss' health in every remaining turn. Only valid if update returned true
+
+        // Save the state after a turn. Returns true if every following turn will be the same as the last one
+        template <class Health> inline bool update(const ArmyCondition<Health> & left, const ArmyCondition<Health> & boss);
+};
+
+template <class Health>
+inline bool SteadyStateDetector::update(const ArmyCondition<Health> & left, const ArmyCondition<Health> & boss) {
+    const int64_t newBossHealth = boss.remainingHealths[boss.monstersLost];
+    bool repeated = hasState &&
+                    boss.armySize == 1 &&
+                    leftMonstersLost == left.monstersLost &&
+                    leftBerserk == left.berserkProcs &&
+                    bossBerserk == boss.berserkProcs &&
+                    newBossHealth <= bossHealth; // Health only changes linearly as long as it doesn't reach the cap from healing
+    for (int i = left.monstersLost; repeated && i < left.armySize; i++) {
+        repeated = leftHealths[i] == left.remainingHealths[i] && leftSkills[i] == left.skillTypes[i];
+    }
+    if (repeated) {
+        switch (left.skillTypes[left.monstersLost]) {
+            case TRAINING:
+            case LUX:
+            case CRIT:      repeated = false;
+            default:        break;
+        }
+        switch (boss.skillTypes[boss.monstersLost]) {
+            case TRAINING:
+            case LUX:
+            case CRIT:
+            case REVENGE:
+            case WITHER:    repeated = false;
+            default:        break;
+        }
+    }
+    if (repeated) {
+        bossHealthChange = newBossHealth - bossHealth;
+        return true;
+    }
+
+    hasState = true;
+    leftMonstersLost = left.monstersLost;
+    leftBerserk = left.berserkProcs;
+    bossBerserk = boss.berserkProcs;
+    bossHealth = newBossHealth;
+    for (int i = left.monstersLost; i < left.armySize; i++) {
+        leftHealths[i] = left.remainingHealths[i];
+        leftSkills[i] = left.skillTypes[i];
+    }
+    return false;
+}
+
+// Seed this army's opponent uses for LUX and CRIT
+template <class Health>
+inline int64_t ArmyCondition<Health>::getTurnSeed(const int turncounter) const {
+    if (profile != nullptr) {
+        return profile->turnSeeds[turncounter];
+    }
+    return calculateTurnSeed(seed, turncounter);
+}
+
+// Maximum amount of armies SiblingFights simulates at once
+const int SIBLING_BATCH_SIZE = 16;
+
+// Damage of an attack without any skills involved. Calculated in the same order as in ArmyCondition::getDamage
+inline int plainDamage(const Monster & attacker, const Monster & defender) {
+    double damage = (double) attacker.damage;
+    if (counter[defender.element] == attacker.element) {
+        damage *= elementalBoost;
+    }
+    return damage > 0 ? castCeil(damage) : 0;
+}
+
+// Simulates armies that continue from the same FightResult against a target without any skills.
+// In a resumed fight all monsters but the last one are already dead, so these armies only differ in their last monster.
+// The state of the target is set up once for all of them and every army becomes one lane of the arrays below.
+// All lanes are simulated in lockstep without branches which allows the compiler to vectorize the exchange of blows.
+// Results are identical to simulateFight for all armies accepted by canSimulate.
+class SiblingFights {
+    private:
+        int32_t leftDamages[ARMY_MAX_SIZE + 1][SIBLING_BATCH_SIZE];  // Damage of each lane against each target monster
+        int32_t rightDamages[ARMY_MAX_SIZE + 1][SIBLING_BATCH_SIZE]; // Damage of each target monster against each lane
+        int32_t startHealths[ARMY_MAX_SIZE + 1];    // Health of the target's monsters when they get to the front
+        int32_t maxHealths[ARMY_MAX_SIZE + 1];
+        int32_t nextAlive[ARMY_MAX_SIZE + 1];       // Next monster that is not already dead from aoe
+        int32_t leftHealths[SIBLING_BATCH_SIZE];
+        int32_t leftMaxHealths[SIBLING_BATCH_SIZE];
+        int32_t frontHealths[SIBLING_BATCH_SIZE];
+        int32_t fronts[SIBLING_BATCH_SIZE];
+        int32_t turns[SIBLING_BATCH_SIZE];
+        int32_t rightDeaths[SIBLING_BATCH_SIZE];
+        int32_t active[SIBLING_BATCH_SIZE];
+
+    public:
+        FightResult results[SIBLING_BATCH_SIZE];
+        bool leftWins[SIBLING_BATCH_SIZE];
+
+        // Check if an army can continue its fight in a batch. The target must not have any skills
+        static bool canSimulate(const Army & army, const Army & target) {
+            return army.lastFightData.valid && army.snapshot == NO_SNAPSHOT &&
+                   army.lastFightData.monstersLost < target.monsterAmount &&
+                   monsterReference[army.monsters[army.monsterAmount - 1]].skill.skillType == NOTHING;
+        }
+
+        // Check if two armies continue from the same state
+        static bool areSiblings(const Army & a, const Army & b) {
+            const FightResult & x = a.lastFightData;
+            const FightResult & y = b.lastFightData;
+            return x.frontHealth == y.frontHealth && x.monstersLost == y.monstersLost && x.turncounter == y.turncounter &&
+                   x.leftBackDamage == y.leftBackDamage && x.leftBackLethal == y.leftBackLethal &&
+                   x.rightAoeDamage == y.rightAoeDamage && x.berserk == y.berserk;
+        }
+
+        // Simulate the fights of up to SIBLING_BATCH_SIZE siblings. Results are written into results and leftWins, not into the armies
+        inline void simulate(const Army * const lanes[], const int laneAmount, const Army & target);
+};
+
+inline void SiblingFights::simulate(const Army * const lanes[], const int laneAmount, const Army & target) {
+    const FightResult & start = lanes[0]->lastFightData;
+    const int32_t targetSize = target.monsterAmount;
+    int l, k;
+
+    // Set up the target. Monsters killed by aoe earlier die as soon as the monster in front of them does
+    startHealths[targetSize] = 0;
+    maxHealths[targetSize] = 0;
+    nextAlive[targetSize] = targetSize;
+    for (k = (int) targetSize - 1; k >= 0; k--) {
+        maxHealths[k] = monsterReference[target.monsters[k]].hp;
+        startHealths[k] = std::min(maxHealths[k] - start.rightAoeDamage, maxHealths[k]);
+        nextAlive[k] = (k + 1 == targetSize || startHealths[k + 1] > 0) ? k + 1 : nextAlive[k + 1];
+    }
+
+    // Set up one lane per sibling
+    for (l = 0; l < laneAmount; l++) {
+        const Monster & monster = monsterReference[lanes[l]->monsters[lanes[l]->monsterAmount - 1]];
+        for (k = 0; k < targetSize; k++) {
+            leftDamages[k][l] = plainDamage(monster, monsterReference[target.monsters[k]]);
+            rightDamages[k][l] = plainDamage(monsterReference[target.monsters[k]], monster);
+        }
+        leftDamages[targetSize][l] = 0;
+        rightDamages[targetSize][l] = 0;
+        leftMaxHealths[l] = monster.hp;
+        leftHealths[l] = monster.hp > start.leftBackLethal ? monster.hp - start.leftBackDamage : 0;
+        frontHealths[l] = start.frontHealth;
+        fronts[l] = start.monstersLost;
+        turns[l] = start.turncounter;
+        rightDeaths[l] = 0;
+        active[l] = leftHealths[l] > 0;
+    }
+
+    // Battle Loop. Finished lanes keep their state until all are done
+    bool anyActive = true;
+    for (int turncounter = start.turncounter; anyActive && turncounter < 100; turncounter++) {
+        anyActive = false;
+        for (l = 0; l < laneAmount; l++) {
+            const int32_t front = fronts[l];
+            const int32_t next = nextAlive[front];
+            leftHealths[l] -= rightDamages[front][l] * active[l];
+            frontHealths[l] -= leftDamages[front][l] * active[l];
+
+            // Dead monsters are not healed, so capping the health of dead lanes doesn't matter
+            leftHealths[l] = active[l] ? std::min(leftHealths[l], leftMaxHealths[l]) : leftHealths[l];
+            const int32_t frontDies = active[l] & (frontHealths[l] <= 0);
+            frontHealths[l] = frontDies ? startHealths[next] : (active[l] ? std::min(frontHealths[l], maxHealths[front]) : frontHealths[l]);
+            fronts[l] = frontDies ? next : front;
+            rightDeaths[l] |= frontDies;
+            turns[l] += active[l];
+            active[l] &= (leftHealths[l] > 0) & (fronts[l] < targetSize);
+            anyActive |= active[l] != 0;
+        }
+    }
+
+    // write all the results into FightResults
+    for (l = 0; l < laneAmount; l++) {
+        results[l] = lanes[l]->lastFightData;
+        results[l].dominated = false;
+        results[l].turncounter = (int8_t) turns[l];
+        leftWins[l] = leftHealths[l] > 0; // draws count as right wins.
+        if (!leftWins[l]) {
+            results[l].monstersLost = (int8_t) fronts[l];
+            results[l].berserk = rightDeaths[l] ? 0 : start.berserk;
+            results[l].frontHealth = fronts[l] < targetSize ? frontHealths[l] : 0;
+        } else {
+            results[l].monstersLost = (int8_t) (lanes[l]->monsterAmount - 1);
+            results[l].frontHealth = leftHealths[l];
+            results[l].berserk = 0;
+        }
+    }
+}
+
+// Maximum amount of turns with LUX or CRIT a FightSnapshot can hold
+const int MAX_GAMBLES = 12;
+
+// The part of the target's state a FightResult can't hold: the health of every monster behind the frontliner.
+// Only stored for fights in which these healths don't follow from rightAoeDamage, f.e. after valkyrie or healing.
+// Against DICE, LUX and CRIT it also holds everything the target decided based on the seed of left.
+// A longer army only continues the fight if its seed leads to the same decisions
+struct FightSnapshot {
+    int32_t rightHealths[ARMY_MAX_SIZE];
+    int64_t leftSeed;
+    uint8_t gambleAmount;                   // Turns in which the target's frontliner used LUX or CRIT
+    uint8_t gambleTurns[MAX_GAMBLES];
+    uint8_t gambleRanges[MAX_GAMBLES];      // Amount of monsters of left LUX picked from, 0 for CRIT
+};
+
+// Holds the FightSnapshots of the armies of one size. Fights add snapshots concurrently.
+// Memory is allocated in blocks as it is needed up to a fixed capacity. Once that is used up add fails
+// and the armies it failed for have to be simulated from the start when they are expanded.
+class SnapshotStore {
+    private:
+        static const size_t BLOCK_SIZE = 1 << 14;
+
+        std::unique_ptr<std::atomic<FightSnapshot *>[]> blocks;
+        size_t blockAmount;
+        std::atomic<size_t> used;
+        std::mutex lock;
+
+    public:
+        SnapshotStore();
+        ~SnapshotStore();
+
+        // Free all snapshots and allow at most bytes of memory from now on
+        void setCapacity(const size_t bytes);
+
+        // Forget all snapshots but keep their memory
+        void clear();
+
+        // Store a snapshot and return its index. Returns MISSING_SNAPSHOT if the store is full
+        uint32_t add(const FightSnapshot & snapshot);
+
+        // Only valid until the store is cleared
+        const FightSnapshot & operator[](const uint32_t index) const {
+            return blocks[index / BLOCK_SIZE].load(std::memory_order_relaxed)[index % BLOCK_SIZE];
+        }
+};
+
+// Check if two FightResults describe the same state to resume a fight from
+inline bool isSameResumeState(const FightResult & a, const FightResult & b) {
+    return a.frontHealth == b.frontHealth && a.monstersLost == b.monstersLost && a.turncounter == b.turncounter &&
+           a.berserk == b.berserk && a.rightAoeDamage == b.rightAoeDamage &&
+           a.leftBackDamage == b.leftBackDamage && a.leftBackLethal == b.leftBackLethal;
+}
+
+// Hash of the state to resume a fight from, mixed with extra
+inline uint64_t hashResumeState(const FightResult & state, const uint64_t extra) {
+    uint64_t hash = (uint64_t) state.frontHealth * 0x9E3779B97F4A7C15ULL;
+    hash ^= ((uint64_t) (uint16_t) state.rightAoeDamage << 48) ^ ((uint64_t) (uint16_t) state.leftBackDamage << 32) ^
+            ((uint64_t) (uint16_t) state.leftBackLethal << 16) ^ ((uint64_t) (uint8_t) state.turncounter << 8) ^ extra;
+    hash = (hash ^ (hash >> 29)) * 0xBF58476D1CE4E5B9ULL;
+    hash ^= ((uint64_t) (uint8_t) state.monstersLost << 8) ^ (uint64_t) (uint8_t) state.berserk;
+    hash = (hash ^ (hash >> 32)) * 0x94D049BB133111EBULL;
+    return hash;
+}
+
+// Outcomes of resumed fights. A resumed fight only depends on the state the old fight ended in and the monster added
+// to the army, unless the target decides something based on the army's seed. Many different armies end in the same state.
+// Safe to use from all workers and bounded: every state maps to a set of WAYS entries, the least recently used one of them is replaced.
+class SuffixMemo {
+    private:
+        static const int WAYS = 4;
+
+        struct Entry {
+            FightResult start;  // State the fight was resumed from
+            FightResult end;    // leftAoeDamage only counts the aoe taken after start
+            MonsterIndex monster;
+            bool leftWins;
+            uint32_t generation;    // Entries of older generations are empty
+            uint32_t lastUse;
+        };
+        struct Set {
+            std::atomic_flag lock;
+            uint32_t clock;
+            Entry entries[WAYS];
+        };
+
+        std::unique_ptr<Set[]> sets;
+        size_t setMask;
+        uint32_t generation;
+
+        inline Set * getSet(const FightResult & start, const MonsterIndex monster);
+
+    public:
+        SuffixMemo();
+
+        // Use at most bytes of memory. 0 disables the memo. Memory is only touched again if the capacity changed
+        void setCapacity(const size_t bytes);
+
+        // Forget all outcomes
+        void clear() {
+            this->generation++;
+        }
+
+        bool isEnabled() const {
+            return this->sets != nullptr;
+        }
+
+        // Look up the outcome of adding monster to an army whose fight ended in start
+        bool find(const FightResult & start, const MonsterIndex monster, FightResult & end, bool & leftWins);
+
+        void insert(const FightResult & start, const MonsterIndex monster, const FightResult & end, const bool leftWins);
+};
+
+// Conditions of both sides of a fight
+template <class Health>
+struct FightConditions {
+    ArmyCondition<Health> left;
+    ArmyCondition<Health> right;
+};
+
+// Everything a fight writes to while it is simulated.
+// simulateFight only touches the context it is given, so every thread needs its own FightContext to run fights concurrently
+class FightContext {
+    public:
+        FightConditions<int32_t> narrowConditions;  // Used by all fights without worldbosses
+        FightConditions<int64_t> wideConditions;
+        FightResult result;         // Result of the last fight simulated with this context
+        SiblingFights siblingFights;
+        int fightsSimulated = 0;    // Amount of fights simulated with this context
+
+        SnapshotStore * snapshots = nullptr;                // Receives the snapshots of the fights. None are stored if nullptr
+        const SnapshotStore * parentSnapshots = nullptr;    // Holds the snapshots the armies' lastFightData refer to
+        FightSnapshot snapshot;                             // Decisions of the target in the current fight
+        SuffixMemo * memo = nullptr;    // Outcomes of resumed fights. Must be nullptr if the target has DICE, LUX or CRIT
+        int memoLookups = 0;
+        int memoHits = 0;
+
+        template <class Health> FightConditions<Health> & getConditions();
+};
+
+template <>
+inline FightConditions<int32_t> & FightContext::getConditions<int32_t>() {
+    return narrowConditions;
+}
+
+template <>
+inline FightConditions<int64_t> & FightContext::getConditions<int64_t>() {
+    return wideConditions;
+}
+
+// Check if an army has a monster with DICE
+inline bool rollsDice(const Army & army) {
+    for (int i = 0; i < army.monsterAmount; i++) {
+        if (monsterReference[army.monsters[i]].skill.skillType == DICE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Check if the seed of left makes the DICE, LUX and CRIT of right decide the same way they did in the fight of snapshot.
+// left has one more monster than the army of snapshot, so LUX picks from one more monster
+inline bool repeatsGambles(const FightSnapshot & snapshot, const Army & left, const Army & right) {
+    for (int i = 0; i < right.monsterAmount; i++) {
+        const HeroSkill & skill = monsterReference[right.monsters[i]].skill;
+        if (skill.skillType == DICE && left.seed % ((int) skill.amount + 1) != snapshot.leftSeed % ((int) skill.amount + 1)) {
+            return false;
+        }
+    }
+    for (int k = 0; k < snapshot.gambleAmount; k++) {
+        const int64_t oldTurnSeed = calculateTurnSeed(snapshot.leftSeed, snapshot.gambleTurns[k]);
+        const int64_t newTurnSeed = calculateTurnSeed(left.seed, snapshot.gambleTurns[k]);
+        const int range = snapshot.gambleRanges[k];
+        if (range == 0 ? (oldTurnSeed % 2 == 1) != (newTurnSeed % 2 == 1) : oldTurnSeed % range != newTurnSeed % (range + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Remember a turn in which the target's frontliner used LUX or CRIT
+inline void recordGamble(FightSnapshot & snapshot, const int turncounter, const int range) {
+    if (snapshot.gambleAmount < MAX_GAMBLES) {
+        snapshot.gambleTurns[snapshot.gambleAmount] = (uint8_t) turncounter;
+        snapshot.gambleRanges[snapshot.gambleAmount] = (uint8_t) range;
+    }
+    snapshot.gambleAmount++;
+}
+
+// Store the healths of the target's monsters behind the frontliner unless they all follow from rightAoeDamage
+// and the target made no decisions based on the seed of left.
+// Returns the value for Army::snapshot. Worldbosses fight alone, so their fights never need a snapshot
+template <unsigned Features, class Health>
+inline uint32_t storeSnapshot(const Army & right, const ArmyCondition<Health> & rightCondition, const FightResult & result, FightContext & context) {
+    FightSnapshot & snapshot = context.snapshot;
+    bool needed = (Features & FIGHT_GAMBLER) && (snapshot.gambleAmount > 0 || rollsDice(right));
+    for (int i = rightCondition.monstersLost + 1; i < rightCondition.armySize; i++) {
+        const int64_t restoredHealth = rightCondition.lineup[i]->hp - result.rightAoeDamage;
+        needed |= rightCondition.remainingHealths[i] <= 0 ? restoredHealth > 0 : rightCondition.remainingHealths[i] != restoredHealth;
+    }
+    if (!needed) {
+        return NO_SNAPSHOT;
+    }
+    if ((Features & FIGHT_WORLDBOSS) || context.snapshots == nullptr || ((Features & FIGHT_GAMBLER) && snapshot.gambleAmount > MAX_GAMBLES)) {
+        return MISSING_SNAPSHOT;
+    }
+    for (int i = rightCondition.monstersLost + 1; i < rightCondition.armySize; i++) {
+        snapshot.rightHealths[i] = (int32_t) rightCondition.remainingHealths[i];
+    }
+    return context.snapshots->add(snapshot);
+}
+
+// Follow a monster waiting behind left through one turn. It takes the aoe and is healed afterwards if it survived
+inline void trackBackDamage(FightResult & result, const int damage, const int healing) {
+    const int backDamage = std::min(result.leftBackDamage + damage, (int) std::numeric_limits<int16_t>::max());
+    result.leftBackLethal = (int16_t) std::max((int) result.leftBackLethal, backDamage);
+    result.leftBackDamage = (int16_t) std::max(0, backDamage - healing);
+}
 
 // Simulates One fight between 2 Armies and writes results into left's LastFightData
-inline bool simulateFight(Army & left, Army & right, bool verbose = false) {
+// Only context is modified apart from left, making it safe to call from multiple threads with different contexts
+// rightProfile is optional and must be compiled from right. It replaces everything that only depends on right
+// Features is a mask of FightFeatures that can occur in the fight, everything else is compiled out.
+// Health values are 32 bit wide unless the fight involves a worldboss
+// If left lost and the target's state doesn't follow from the FightResult, it is stored in context.snapshots
+template <unsigned Features>
+inline bool simulateFight(Army & left, const Army & right, const TargetProfile * rightProfile, FightContext & context, bool verbose = false) {
     // left[0] and right[0] are the first monsters to fight
-    (*totalFightsSimulated)++;
+    context.fightsSimulated++;
+
+    using Health = FightHealth<Features>;
+    ArmyCondition<Health> & leftCondition = context.getConditions<Health>().left;
+    ArmyCondition<Health> & rightCondition = context.getConditions<Health>().right;
+    FightResult & result = context.result;
+    result = left.lastFightData;
 
     int turncounter;
+    bool leftWins;
+    int16_t leftAoeIncrease, rightAoeIncrease;
+    int backHealing = 0;
+    SteadyStateDetector steadyState;
+
+    // The target's state is complete if it needed no snapshot or the snapshot can be found.
+    // Against DICE, LUX and CRIT the seed of left must also lead to the decisions made in the snapshot's fight
+    bool resumable = result.valid && !verbose;
+    const FightSnapshot * parentSnapshot = nullptr;
+    if (resumable && left.snapshot != NO_SNAPSHOT) {
+        resumable = left.snapshot != MISSING_SNAPSHOT && context.parentSnapshots != nullptr;
+        if (resumable) {
+            parentSnapshot = &(*context.parentSnapshots)[left.snapshot];
+            resumable = !(Features & FIGHT_GAMBLER) || repeatsGambles(*parentSnapshot, left, right);
+        }
+    }
+
+    // Resumed fights without a snapshot only depend on the old result and the new monster and can be looked up
+    const bool memoized = resumable && parentSnapshot == nullptr && context.memo != nullptr;
+    const MonsterIndex addedMonster = memoized ? left.monsters[left.monsterAmount - 1] : 0;
+    FightResult memoStart;
+    if (memoized) {
+        context.memoLookups++;
+        memoStart = result;
+        if (context.memo->find(memoStart, addedMonster, result, leftWins)) {
+            context.memoHits++;
+            result.leftAoeDamage = (int16_t) (result.leftAoeDamage + memoStart.leftAoeDamage);
+            result.valid = memoStart.valid;
+            if (leftWins) {
+                result.monstersLost = (int8_t) (left.monsterAmount - 1);
+            }
+            left.lastFightData = result;
+            left.snapshot = NO_SNAPSHOT;
+            return leftWins;
+        }
+    }
 
     // Ignore lastFightData if either army-affecting heroes were added or for debugging
-    if (left.lastFightData.valid && !verbose) {
+    if (resumable) {
         // Set pre-computed values to pick up where we left off
-        leftCondition.init(left, left.monsterAmount-1, left.lastFightData.leftAoeDamage);
-        rightCondition.init(right, left.lastFightData.monstersLost, left.lastFightData.rightAoeDamage);
+        leftCondition.init(left, left.monsterAmount-1, result.leftBackDamage);
+        rightCondition.init(right, result.monstersLost, result.rightAoeDamage);
+        rightCondition.profile = rightProfile;
+        const int newMonster = leftCondition.monstersLost;
+        if ((Features & FIGHT_GAMBLER) && leftCondition.skillTypes[newMonster] == DICE) {
+            leftCondition.maxHealths[newMonster] += rightCondition.seed % ((int) leftCondition.skillAmounts[newMonster] + 1);
+            leftCondition.remainingHealths[newMonster] = leftCondition.maxHealths[newMonster] - result.leftBackDamage;
+        }
         // Check if the new addition died to Aoe
-        if (leftCondition.remainingHealths[leftCondition.monstersLost] <= 0) {
+        if (leftCondition.maxHealths[newMonster] <= result.leftBackLethal || leftCondition.remainingHealths[newMonster] <= 0) {
             leftCondition.monstersLost++;
         }
+        if (parentSnapshot != nullptr) {
+            for (int i = rightCondition.monstersLost + 1; i < rightCondition.armySize; i++) {
+                rightCondition.remainingHealths[i] = parentSnapshot->rightHealths[i];
+            }
+        }
+        if (Features & FIGHT_GAMBLER) {
+            // Continue the decisions of the old fight, they were the same for the longer army
+            FightSnapshot & snapshot = context.snapshot;
+            snapshot.leftSeed = left.seed;
+            snapshot.gambleAmount = parentSnapshot != nullptr ? parentSnapshot->gambleAmount : 0;
+            for (int k = 0; k < snapshot.gambleAmount; k++) {
+                snapshot.gambleTurns[k] = parentSnapshot->gambleTurns[k];
+                snapshot.gambleRanges[k] = parentSnapshot->gambleRanges[k] + (parentSnapshot->gambleRanges[k] != 0);
+            }
+            for (int i = rightCondition.monstersLost; i < rightCondition.armySize; i++) {
+                if (rightCondition.skillTypes[i] == DICE) {
+                    rightCondition.maxHealths[i] += leftCondition.seed % ((int) rightCondition.skillAmounts[i] + 1);
+                }
+            }
+        }
+        // Monsters behind the frontliner that died already lost their skill
+        for (int i = rightCondition.monstersLost + 1; i < rightCondition.armySize; i++) {
+            if (rightCondition.remainingHealths[i] <= 0) {
+                rightCondition.skillTypes[i] = NOTHING;
+                rightCondition.skillsLost = true;
+            }
+        }
 
-        rightCondition.remainingHealths[rightCondition.monstersLost] = left.lastFightData.frontHealth;
-        rightCondition.berserkProcs        = left.lastFightData.berserk;
-        turncounter                        = left.lastFightData.turncounter;
+        rightCondition.remainingHealths[rightCondition.monstersLost] = result.frontHealth;
+        rightCondition.berserkProcs        = result.berserk;
+        turncounter                        = result.turncounter;
     } else {
         // Load Army data into conditions
         leftCondition.init(left, 0, 0);
         rightCondition.init(right, 0, 0);
+        rightCondition.profile = rightProfile;
 
         //----- turn zero -----
 
         // Apply Dicemaster max health bonus here, attack bonus applied during battle
-        for (int i = 0; i < leftCondition.armySize; i++) {
-            if (leftCondition.skillTypes[i] == DICE) {
-                leftCondition.maxHealths[i] += rightCondition.seed % ((int)leftCondition.skillAmounts[i] + 1);
-                leftCondition.remainingHealths[i] = leftCondition.maxHealths[i];
+        if (Features & FIGHT_GAMBLER) {
+            context.snapshot.leftSeed = left.seed;
+            context.snapshot.gambleAmount = 0;
+            for (int i = 0; i < leftCondition.armySize; i++) {
+                if (leftCondition.skillTypes[i] == DICE) {
+                    leftCondition.maxHealths[i] += rightCondition.seed % ((int)leftCondition.skillAmounts[i] + 1);
+                    leftCondition.remainingHealths[i] = leftCondition.maxHealths[i];
+                }
             }
         }
 
-        for (int i = 0; i < rightCondition.armySize; i++) {
-            if (rightCondition.skillTypes[i] == DICE) {
-                rightCondition.maxHealths[i] += leftCondition.seed % ((int)rightCondition.skillAmounts[i] + 1);
-                rightCondition.remainingHealths[i] = rightCondition.maxHealths[i];
+        if ((Features & FIGHT_GAMBLER) && (rightProfile == nullptr || rightProfile->hasDice)) {
+            for (int i = 0; i < rightCondition.armySize; i++) {
+                if (rightCondition.skillTypes[i] == DICE) {
+                    rightCondition.maxHealths[i] += leftCondition.seed % ((int)rightCondition.skillAmounts[i] + 1);
+                    rightCondition.remainingHealths[i] = rightCondition.maxHealths[i];
+                }
             }
         }
 
         // Apply Leprechaun's skill (Beer)
-        if (leftCondition.booze && leftCondition.armySize < rightCondition.armySize)
-            for (size_t i = 0; i < ARMY_MAX_SIZE; ++i) {
-                rightCondition.maxHealths[i] = int(rightCondition.maxHealths[i] * leftCondition.armySize / rightCondition.armySize);
-                rightCondition.remainingHealths[i] = rightCondition.maxHealths[i];
+        if ((Features & FIGHT_BEER) && leftCondition.booze && leftCondition.armySize < rightCondition.armySize) {
+            if (rightProfile != nullptr && rightProfile->hasBeerHealths) {
+                for (int i = 0; i < rightCondition.armySize; i++) {
+                    rightCondition.maxHealths[i] = rightProfile->beerHealths[leftCondition.armySize][i];
+                    rightCondition.remainingHealths[i] = rightCondition.maxHealths[i];
+                }
+            } else {
+                for (size_t i = 0; i < ARMY_MAX_SIZE; ++i) {
+                    rightCondition.maxHealths[i] = int(rightCondition.maxHealths[i] * leftCondition.armySize / rightCondition.armySize);
+                    rightCondition.remainingHealths[i] = rightCondition.maxHealths[i];
+                }
             }
+        }
 
-        if (rightCondition.booze && rightCondition.armySize < leftCondition.armySize)
+        if ((Features & FIGHT_BEER) && rightCondition.booze && rightCondition.armySize < leftCondition.armySize)
             for (size_t i = 0; i < ARMY_MAX_SIZE; ++i) {
                 leftCondition.maxHealths[i] = int(leftCondition.maxHealths[i] * rightCondition.armySize / leftCondition.armySize);
                 leftCondition.remainingHealths[i] = leftCondition.maxHealths[i];
             }
 
         // Reset Potential values in fightresults
-        left.lastFightData.leftAoeDamage = 0;
-        left.lastFightData.rightAoeDamage = 0;
+        result.leftAoeDamage = 0;
+        result.rightAoeDamage = 0;
+        result.leftBackDamage = 0;
+        result.leftBackLethal = 0;
         turncounter = 0;
 
         // Apply Hawking's AOE
-        if (leftCondition.aoeZero || rightCondition.aoeZero) {
+        if ((Features & FIGHT_AOE) && (leftCondition.aoeZero || rightCondition.aoeZero)) {
             TurnData turnZero;
             if (leftCondition.aoeZero) {
-                left.lastFightData.rightAoeDamage += leftCondition.aoeZero;
+                result.rightAoeDamage += leftCondition.aoeZero;
                 turnZero.aoeDamage = leftCondition.aoeZero;
-                rightCondition.resolveDamage(turnZero);
+                rightCondition.template resolveDamage<Features>(turnZero);
             }
             if (rightCondition.aoeZero) {
-                left.lastFightData.leftAoeDamage += rightCondition.aoeZero;
+                result.leftAoeDamage += rightCondition.aoeZero;
                 turnZero.aoeDamage = rightCondition.aoeZero;
-                leftCondition.resolveDamage(turnZero);
+                leftCondition.template resolveDamage<Features>(turnZero);
+                trackBackDamage(result, rightCondition.aoeZero, 0);
             }
         }
 
@@ -382,29 +1028,51 @@ inline bool simulateFight(Army & left, Army & right, bool verbose = false) {
     // Battle Loop. Continues until one side is out of monsters
     //TODO: handle 100 turn limit for non-wb, also handle it for wb better maybe
     while (leftCondition.monstersLost < leftCondition.armySize && rightCondition.monstersLost < rightCondition.armySize && turncounter < 100) {
-        leftCondition.startNewTurn();
-        rightCondition.startNewTurn();
+        leftCondition.template startNewTurn<Features>();
+        rightCondition.template startNewTurn<Features>();
 
         // Get damage with all relevant multipliers
-        leftCondition.getDamage(turncounter, rightCondition);
-        rightCondition.getDamage(turncounter, leftCondition);
+        leftCondition.template getDamage<Features>(turncounter, rightCondition);
+        rightCondition.template getDamage<Features>(turncounter, leftCondition);
+
+        if ((Features & FIGHT_GAMBLER) && (rightCondition.skillTypes[rightCondition.monstersLost] == LUX || rightCondition.skillTypes[rightCondition.monstersLost] == CRIT)) {
+            recordGamble(context.snapshot, turncounter, rightCondition.skillTypes[rightCondition.monstersLost] == LUX ? leftCondition.armySize - leftCondition.monstersLost : 0);
+        }
+
+        // Jump ahead if nothing but the same two attacks happens until the next death
+        if (!verbose) {
+            fastForward(leftCondition, rightCondition, turncounter);
+        }
 
         // Handle Revenge Damage before anything else. Revenge Damage caused through aoe is ignored
-        if (leftCondition.skillTypes[leftCondition.monstersLost] == REVENGE &&
+        if ((Features & FIGHT_AOE) && leftCondition.skillTypes[leftCondition.monstersLost] == REVENGE &&
             leftCondition.remainingHealths[leftCondition.monstersLost] <= rightCondition.turnData.baseDamage) {
             leftCondition.turnData.aoeDamage += (int) round((double) leftCondition.lineup[leftCondition.monstersLost]->damage * leftCondition.skillAmounts[leftCondition.monstersLost]);
         }
-        if (rightCondition.skillTypes[rightCondition.monstersLost] == REVENGE &&
+        if ((Features & FIGHT_AOE) && rightCondition.skillTypes[rightCondition.monstersLost] == REVENGE &&
             rightCondition.remainingHealths[rightCondition.monstersLost] <= leftCondition.turnData.baseDamage) {
             rightCondition.turnData.aoeDamage += (int) round((double) rightCondition.lineup[rightCondition.monstersLost]->damage * rightCondition.skillAmounts[rightCondition.monstersLost]);
         }
 
-        left.lastFightData.leftAoeDamage += (int16_t) (rightCondition.turnData.aoeDamage + rightCondition.turnData.paoeDamage);
-        left.lastFightData.rightAoeDamage += (int16_t) (leftCondition.turnData.aoeDamage + leftCondition.turnData.paoeDamage);
+        if (Features & FIGHT_AOE) {
+            leftAoeIncrease = (int16_t) (rightCondition.turnData.aoeDamage + rightCondition.turnData.paoeDamage);
+            rightAoeIncrease = (int16_t) (leftCondition.turnData.aoeDamage + leftCondition.turnData.paoeDamage);
+            result.leftAoeDamage += leftAoeIncrease;
+            result.rightAoeDamage += rightAoeIncrease;
+        } else {
+            leftAoeIncrease = 0;
+            rightAoeIncrease = 0;
+        }
 
         // Check if anything died as a result
-        leftCondition.resolveDamage(rightCondition.turnData);
-        rightCondition.resolveDamage(leftCondition.turnData);
+        leftCondition.template resolveDamage<Features>(rightCondition.turnData);
+        rightCondition.template resolveDamage<Features>(leftCondition.turnData);
+
+        // Resolving added explode damage to the aoe
+        if (Features & FIGHT_AOE) {
+            backHealing = (Features & FIGHT_HEAL) ? leftCondition.turnData.healing : 0;
+            trackBackDamage(result, rightCondition.turnData.aoeDamage + rightCondition.turnData.paoeDamage, backHealing);
+        }
 
         turncounter++;
 
@@ -425,35 +1093,81 @@ inline bool simulateFight(Army & left, Army & right, bool verbose = false) {
                 std::cout << std::setw(4) << rightCondition.remainingHealths[i] << " ";
             } std::cout << std::endl;
         }
+
+        // Skip to the turn limit once every turn against the worldboss is the same
+        if ((Features & FIGHT_WORLDBOSS) && rightCondition.worldboss && !verbose && turncounter < TURN_LIMIT && steadyState.update(leftCondition, rightCondition)) {
+            const int64_t remainingTurns = TURN_LIMIT - turncounter;
+            rightCondition.remainingHealths[rightCondition.monstersLost] += remainingTurns * steadyState.bossHealthChange;
+            result.leftAoeDamage = (int16_t) (result.leftAoeDamage + remainingTurns * leftAoeIncrease);
+            result.rightAoeDamage = (int16_t) (result.rightAoeDamage + remainingTurns * rightAoeIncrease);
+            for (int64_t turn = 0; turn < remainingTurns; turn++) {
+                trackBackDamage(result, leftAoeIncrease, backHealing);
+            }
+            turncounter = TURN_LIMIT;
+        }
     }
 
     // how 100 turn limit is handled for WB
-    if (turncounter >= 100 && rightCondition.worldboss == true) {
+    if ((Features & FIGHT_WORLDBOSS) && turncounter >= 100 && rightCondition.worldboss == true) {
         leftCondition.monstersLost = leftCondition.armySize;
     }
 
     // write all the results into a FightResult
-    left.lastFightData.dominated = false;
-    left.lastFightData.turncounter = (int8_t) turncounter;
+    result.dominated = false;
+    result.turncounter = (int8_t) turncounter;
 
     if (leftCondition.monstersLost >= leftCondition.armySize) { //draws count as right wins.
-        left.lastFightData.monstersLost = (int8_t) rightCondition.monstersLost;
-        left.lastFightData.berserk = (int8_t) rightCondition.berserkProcs;
+        result.monstersLost = (int8_t) rightCondition.monstersLost;
+        result.berserk = (int8_t) rightCondition.berserkProcs;
         if (rightCondition.monstersLost < rightCondition.armySize) {
-            left.lastFightData.frontHealth = (int64_t) (rightCondition.remainingHealths[rightCondition.monstersLost]);
+            result.frontHealth = (int64_t) (rightCondition.remainingHealths[rightCondition.monstersLost]);
         } else {
-            left.lastFightData.frontHealth = 0;
+            result.frontHealth = 0;
         }
-        return false;
+        left.snapshot = storeSnapshot<Features>(right, rightCondition, result, context);
+        leftWins = false;
     } else {
-        left.lastFightData.monstersLost = (int8_t) leftCondition.monstersLost;
-        left.lastFightData.frontHealth = (int64_t) (leftCondition.remainingHealths[leftCondition.monstersLost]);
-        left.lastFightData.berserk = (int8_t) leftCondition.berserkProcs;
-        return true;
+        result.monstersLost = (int8_t) leftCondition.monstersLost;
+        result.frontHealth = (int64_t) (leftCondition.remainingHealths[leftCondition.monstersLost]);
+        result.berserk = (int8_t) leftCondition.berserkProcs;
+        left.snapshot = NO_SNAPSHOT;
+        leftWins = true;
+    }
+    left.lastFightData = result;
+
+    if (memoized && left.snapshot == NO_SNAPSHOT) {
+        result.leftAoeDamage = (int16_t) (result.leftAoeDamage - memoStart.leftAoeDamage);
+        context.memo->insert(memoStart, addedMonster, result, leftWins);
     }
+    return leftWins;
+}
+
+// Pointer to one specialization of simulateFight
+using FightFunction = bool (*)(Army & left, const Army & right, const TargetProfile * rightProfile, FightContext & context, bool verbose);
+
+// Specializations of simulateFight for every mask of FightFeatures
+extern FightFunction fightFunctions[FIGHT_ALL + 1];
+
+// Simulates a fight without a precompiled profile of right
+inline bool simulateFight(Army & left, const Army & right, FightContext & context, bool verbose = false) {
+    return simulateFight<FIGHT_ALL>(left, right, nullptr, context, verbose);
+}
+
+// Simulates a fight against the target of an instance using its TargetProfile and the kernel for its fightFeatures
+inline bool simulateFight(Army & left, const Instance & instance, FightContext & context) {
+    return fightFunctions[instance.fightFeatures](left, instance.target, &instance.targetProfile, context, false);
+}
+
+extern FightContext defaultFightContext;
+
+// Simulates a fight using the shared default context. Not thread safe, only use this outside of the solver's worker threads
+inline bool simulateFight(Army & left, Army & right, bool verbose = false) {
+    (*totalFightsSimulated)++;
+    return simulateFight(left, right, defaultFightContext, verbose);
 }
 
-// Function determining if a monster is strictly better than another
-bool isBetter(Monster * a, Monster * b, bool considerAbilities = false);
+// Function determining if monster a is at least as good as monster b against every monster of a target without skills:
+// It has at least as much health, deals at least as much damage to and takes at most as much damage from each of them
+bool isBetter(const Monster & a, const Monster & b, const Army & target);
 
 #endif
@@ -1,5 +1,12 @@
 #include "cosmosData.h"
 
+#ifndef _WIN32
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 // Private constructor that is called by all public ones. Fully initializes all attributes
 Monster::Monster(int someHp, int someDamage, FollowerCount aCost, std::string aName, Element anElement, HeroRarity aRarity, HeroSkill aSkill, int aLevel) :
     hp(someHp),
@@ -99,6 +106,125 @@ std::string Monster::toJSON() {
     return s.str();
 }
 
+void * mapSpillFile(const size_t bytes, const std::string & directory) {
+#ifndef _WIN32
+    // The file is unlinked right away, the mapping keeps it alive until it is unmapped
+    std::string path = directory + "/cosmosquest_spill_XXXXXX";
+    int file = mkstemp(&path[0]);
+    if (file < 0) {
+        return nullptr;
+    }
+    unlink(path.c_str());
+    // A sparse file would only claim its blocks when the mapping is written, and a full disk would kill the process then
+    void * mapping = MAP_FAILED;
+    if (bytes > 0 && posix_fallocate(file, 0, (off_t) bytes) == 0) {
+        mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    }
+    close(file);
+    return mapping != MAP_FAILED ? mapping : nullptr;
+#else
+    return nullptr; // No spill files without mmap
+#endif
+}
+
+void unmapSpillFile(void * mapping, const size_t bytes) {
+#ifndef _WIN32
+    munmap(mapping, bytes);
+#endif
+}
+
+ArmyNodeBuffer::ArmyNodeBuffer() :
+    nodes(nullptr),
+    used(0),
+    capacity(0)
+{}
+
+ArmyNodeBuffer::ArmyNodeBuffer(ArmyNodeBuffer && other) :
+    nodes(other.nodes),
+    used(other.used),
+    capacity(other.capacity),
+    spillDirectory(other.spillDirectory)
+{
+    other.nodes = nullptr;
+    other.used = 0;
+    other.capacity = 0;
+    other.spillDirectory.clear();
+}
+
+ArmyNodeBuffer::~ArmyNodeBuffer() {
+    this->release();
+}
+
+void ArmyNodeBuffer::reserve(const size_t amount) {
+    if (amount > this->capacity) {
+        this->allocate(amount, this->spillDirectory);
+    }
+}
+
+bool ArmyNodeBuffer::reserveSpilled(const size_t amount, const std::string & directory) {
+    return amount <= this->capacity || this->allocate(amount, directory.empty() ? "." : directory);
+}
+
+bool ArmyNodeBuffer::allocate(const size_t newCapacity, const std::string & directory) {
+    ArmyNode * newNodes;
+    if (directory.empty()) {
+        newNodes = new ArmyNode[newCapacity];
+    } else {
+        newNodes = (ArmyNode *) mapSpillFile(newCapacity * sizeof(ArmyNode), directory);
+        if (newNodes == nullptr) {
+            return false;
+        }
+#ifndef _WIN32
+        madvise(newNodes, newCapacity * sizeof(ArmyNode), MADV_SEQUENTIAL);
+#endif
+    }
+    std::copy(this->nodes, this->nodes + this->used, newNodes);
+    size_t usedNodes = this->used;
+    this->release();
+    this->nodes = newNodes;
+    this->used = usedNodes;
+    this->capacity = newCapacity;
+    this->spillDirectory = directory;
+    return true;
+}
+
+void ArmyNodeBuffer::release() {
+    if (this->isSpilled()) {
+        unmapSpillFile(this->nodes, this->capacity * sizeof(ArmyNode));
+    } else {
+        delete[] this->nodes;
+    }
+    this->nodes = nullptr;
+    this->used = 0;
+    this->capacity = 0;
+    this->spillDirectory.clear();
+}
+
+ArmyTreeReader::ArmyTreeReader(const ArmyTree & aTree) :
+    tree(aTree)
+{
+    for (size_t level = 0; level < ARMY_MAX_SIZE; level++) {
+        this->indices[level] = ArmyTree::NO_PARENT;
+    }
+}
+
+const Army & ArmyTreeReader::get(const size_t level, const uint32_t index) {
+    Army & army = this->armies[level];
+    if (this->indices[level] != index) {
+        const ArmyNode & node = this->tree.getNode(level, index);
+        if (level == 0) {
+            army = Army();
+        } else {
+            army = this->get(level - 1, node.parent);
+        }
+        army.add(node.monster);
+        army.lastFightData = node.lastFightData;
+        army.snapshot = node.snapshot;
+        this->indices[level] = index;
+    }
+    return army;
+}
+
 std::string Army::toString() {
     std::stringstream s;
     s << "[";
@@ -145,6 +271,8 @@ void Instance::setTarget(Army aTarget) {
     this->hasBeer = false;
     this->hasGambler = false;
     this->hasWorldBoss = false;
+    this->hasSkills = false;
+    this->fightFeatures = FIGHT_ALL;
     for (size_t i = 0; i < this->targetSize; i++) {
         currentSkill = monsterReference[this->target.monsters[i]].skill;
         this->hasAoe |= currentSkill.hasAoe;
@@ -153,8 +281,11 @@ void Instance::setTarget(Army aTarget) {
         this->hasBeer |= currentSkill.skillType == BEER;
         this->hasGambler |= currentSkill.skillType == DICE || currentSkill.skillType == LUX || currentSkill.skillType == CRIT;
         this->hasWorldBoss |= monsterReference[this->target.monsters[i]].rarity == WORLDBOSS;
+        this->hasSkills |= currentSkill.skillType != NOTHING;
     }
 
+    this->targetProfile.compile(this->target);
+
     // Check which monsters can survive a hit from the final monster on the target. This helps reduce the amount of potential solutions in the last expand
     // Heroes with global Abilities also get accepted.
     // This produces only false positives not false negatives -> no correct solutions lost
@@ -169,6 +300,89 @@ void Instance::setTarget(Army aTarget) {
     }
 }
 
+// Gather everything the battle logic would otherwise calculate for the target in every fight
+// Totals are summed up in the same order as in ArmyCondition::startNewTurn to get identical results
+void TargetProfile::compile(const Army & target) {
+    int size = target.monsterAmount;
+    for (int front = 0; front < size; front++) {
+        Element frontElement = monsterReference[target.monsters[front]].element;
+        this->protection[front] = 0;
+        this->buffDamage[front] = 0;
+        this->aoeDamage[front] = 0;
+        this->healing[front] = 0;
+        this->dampFactor[front] = 1;
+        this->absorbMult[front] = 0;
+        for (int i = front; i < size; i++) {
+            const HeroSkill & skill = monsterReference[target.monsters[i]].skill;
+            bool targeted = skill.target == ALL || skill.target == frontElement;
+            switch (skill.skillType) {
+                default:        break;
+                case PROTECT:   if (targeted) this->protection[front] += (int) skill.amount;
+                                break;
+                case BUFF:      if (targeted) this->buffDamage[front] += (int) skill.amount;
+                                break;
+                case CHAMPION:  if (targeted) {
+                                    this->buffDamage[front] += (int) skill.amount;
+                                    this->protection[front] += (int) skill.amount;
+                                } break;
+                case HEAL:      this->healing[front] += (int) skill.amount;
+                                break;
+                case AOE:       this->aoeDamage[front] += (int) skill.amount;
+                                break;
+                case LIFESTEAL: this->aoeDamage[front] += (int) skill.amount;
+                                this->healing[front] += (int) skill.amount;
+                                break;
+                case DAMPEN:    this->dampFactor[front] *= skill.amount;
+                                break;
+                case ABSORB:    if (i != front) this->absorbMult[front] += skill.amount;
+                                break;
+            }
+        }
+    }
+
+    for (int turn = 0; turn < TURN_LIMIT; turn++) {
+        this->turnSeeds[turn] = calculateTurnSeed(target.seed, turn);
+    }
+
+    this->hasDice = false;
+    for (int i = 0; i < size; i++) {
+        this->hasDice |= monsterReference[target.monsters[i]].skill.skillType == DICE;
+    }
+
+    // DICE changes max health before BEER is applied, so BEER can only be precomputed without DICE
+    this->hasBeerHealths = !this->hasDice;
+    for (int opponentSize = 1; opponentSize < size; opponentSize++) {
+        for (int i = 0; i < size; i++) {
+            this->beerHealths[opponentSize][i] = int((int64_t) monsterReference[target.monsters[i]].hp * opponentSize / size);
+        }
+    }
+}
+
+// Get the FightFeatures a monster brings into every fight it takes part in
+unsigned getFightFeatures(const Monster & monster) {
+    const HeroSkill & skill = monster.skill;
+    unsigned features = 0;
+    if (skill.skillType != NOTHING || monster.rarity == WORLDBOSS) {
+        features |= FIGHT_SKILLS;
+    }
+    if (skill.hasAoe || skill.skillType == ABSORB || skill.skillType == AOEZero_L) {
+        features |= FIGHT_AOE;
+    }
+    if (skill.hasHeal) {
+        features |= FIGHT_HEAL;
+    }
+    if (skill.skillType == BEER) {
+        features |= FIGHT_BEER;
+    }
+    if (skill.skillType == DICE || skill.skillType == LUX || skill.skillType == CRIT) {
+        features |= FIGHT_GAMBLER;
+    }
+    if (monster.rarity == WORLDBOSS) {
+        features |= FIGHT_WORLDBOSS;
+    }
+    return features;
+}
+
 // Returns the index of a quest if the lineup is the same. Returns -1 if not a quest
 int isQuest(Army & army) {
     bool match;
@@ -697,6 +911,7 @@ void initGameData() {
 
     for (size_t i = 0; i < monsterBaseList.size(); i++) {
         monsterReference.push_back(monsterBaseList[i]);
+        monsterReference.back().realIndex = getRealIndex(monsterReference.back());
         monsterMap.insert(std::pair<std::string, MonsterIndex>(monsterBaseList[i].name, i));
     }
 }
@@ -717,6 +932,7 @@ void filterMonsterData(FollowerCount minimumMonsterCost, FollowerCount maximumAr
 // Add a leveled hero to the database and return its corresponding index
 MonsterIndex addLeveledHero(Monster & hero, int level) {
     Monster m(hero, level);
+    m.realIndex = getRealIndex(m);
     monsterReference.emplace_back(m);
 
     return (MonsterIndex) (monsterReference.size() - 1);
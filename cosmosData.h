@@ -10,10 +10,12 @@
 #include <cmath>
 #include <algorithm>
 #include <map>
+#include <limits>
 
 // Version number not used anywhere except in output to know immediately which version the user is running
 const std::string VERSION = "3.0.1.9b";
 
+const size_t MEGABYTE = ((size_t) (1) << 20);
 const size_t GIGABYTE = ((size_t) (1) << 30);
 
 // Alias for dataTypes makes Code more readable
@@ -26,6 +28,7 @@ using FollowerCount = uint32_t;
 // Constants defining the basic structure of armies
 const size_t ARMY_MAX_SIZE = 6;
 const size_t ARMY_MAX_BRUTEFORCEABLE_SIZE = 4;
+const int TURN_LIMIT = 100; // Fights end after this many turns
 const std::string HEROLEVEL_SEPARATOR = ":";
 
 // Needed for BattleReplays
@@ -117,6 +120,17 @@ struct HeroSkill {
 };
 const HeroSkill NO_SKILL = HeroSkill({NOTHING, AIR, AIR, 1}); // base skill used for normal monsters
 
+// Features a fight can involve. simulateFight is compiled for every combination, so fights don't pay for features they can't have
+enum FightFeature {
+    FIGHT_SKILLS    = 1 << 0, // Any monster has a skill. All other features imply this one
+    FIGHT_AOE       = 1 << 1, // Any damage to monsters behind the frontliner. Includes ABSORB and AOEZero_L
+    FIGHT_HEAL      = 1 << 2,
+    FIGHT_BEER      = 1 << 3,
+    FIGHT_GAMBLER   = 1 << 4, // DICE, LUX or CRIT
+    FIGHT_WORLDBOSS = 1 << 5,
+    FIGHT_ALL       = (1 << 6) - 1
+};
+
 // Defines a Monster or Hero
 class Monster {
     private:
@@ -135,6 +149,7 @@ class Monster {
         int level;
 
         std::string name; // display name
+        int realIndex; // Id used ingame, cached for monsters in monsterReference
 
         Monster(int hp, int damage, FollowerCount cost, std::string name, Element element);
         Monster(int hp, int damage, std::string name, Element element, HeroRarity rarity, HeroSkill skill);
@@ -178,8 +193,8 @@ int getRealIndex(Monster & monster);
 // Ideally that would work for any battle. Unfortunately as Abilities grew more complex the amount of data needing to be saved outweigh the benefit of not having to run the fight again.
 // So a few Abilities Invalidate FightResults. Like BUFF. Since the first 5 Monsters would have had more Attack with the buff, the battle might have played out differently.
 // So the data in here can't be used if f.e. a BUFF hero is added to the Army
-// Similarly some Abilities like Valkyrie produce a Fight state that can't be efficiently captured in a FightResult.
-// If one of those heroes is in an Army its FightResult is always invalid
+// Some Abilities like Valkyrie leave the target's monsters behind the frontliner with different healths. That part of the state
+// doesn't fit into a FightResult and is stored separately as a FightSnapshot. If it couldn't be stored the FightResult is invalid
 //
 // In a FightResult it is always implied that the target won against the proposed solution.
 
@@ -189,13 +204,15 @@ struct FightResult {
     DamageType frontHealth;     // how much health remaining to the current leading mob of the winning side
     int16_t leftAoeDamage;      // how much aoe damage left took
     int16_t rightAoeDamage;     // how much aoe damage right took
+    int16_t leftBackDamage;     // how much damage a monster waiting behind left would have taken, healing included
+    int16_t leftBackLethal;     // a monster waiting behind left would have died if it had at most this much health
     int8_t berserk;             // berserk multiplier, if there is a berserker in the front
     int8_t monstersLost;        // how many mobs lost on the winning side (the other side lost all)
     int8_t turncounter;         // how many turns have passed since the battle started
     bool valid;                 // If the result is valid
     bool dominated;             // If the result is worse than another
 
-    FightResult() : valid(false) {}
+    FightResult() : valid(false), dominated(false) {}
 
     // Comparator for FightResults Used to do dominance.
     bool operator <=(const FightResult & toCompare) const { // both results are expected to not have won against the target
@@ -210,6 +227,10 @@ struct FightResult {
     }
 };
 
+// Values of Army::snapshot that don't refer to a FightSnapshot
+const uint32_t NO_SNAPSHOT = 0xFFFFFFFF;       // The state of the target can be restored from the FightResult alone
+const uint32_t MISSING_SNAPSHOT = 0xFFFFFFFE;  // A snapshot was needed but could not be stored. The FightResult can't be resumed
+
 // Defines a single lineup of monsters
 class Army {
     public:
@@ -217,13 +238,19 @@ class Army {
         FollowerCount followerCost;
         MonsterIndex monsters[ARMY_MAX_SIZE];
         int8_t monsterAmount;
+        int8_t heroAmount;
+        uint32_t snapshot;  // Index of the FightSnapshot holding the rest of the target's state after lastFightData
         int64_t seed;
         int64_t strength;
+        uint64_t heroes;    // Heroes of the army in ascending order, one per byte starting with the lowest. Equal sets give equal words
 
         Army(std::vector<MonsterIndex> someMonsters = {}) :
             followerCost(0),
             monsterAmount(0),
-            strength(0)
+            heroAmount(0),
+            snapshot(NO_SNAPSHOT),
+            strength(0),
+            heroes(0)
         {
             for(size_t i = 0; i < someMonsters.size(); i++) {
                 this->add(someMonsters[i]);
@@ -236,12 +263,15 @@ class Army {
             this->followerCost += monsterReference[m].cost;
             this->monsterAmount++;
             strength += pow(monsterReference[m].hp * monsterReference[m].damage, 1.5);
+            if (monsterReference[m].rarity != NO_HERO) {
+                this->addHero(m);
+            }
 
             // Seed takes into account empty spaces with lane size 6, recalculated each time monster is added
             // Any empty spaces are considered to be contiguous and frontmost as they are in DQ and quests
             int64_t newSeed = 1;
             for (int i = monsterAmount - 1; i >= 0; i--) {
-                newSeed = newSeed * abs(getRealIndex(monsterReference[monsters[i]])) + 1;
+                newSeed = newSeed * abs(monsterReference[monsters[i]].realIndex) + 1;
             }
             // Simplification of loop for empty monsters (id: -1) contiguous and frontmost
             newSeed += 6 - monsterAmount;
@@ -251,14 +281,221 @@ class Army {
             return (this->monsterAmount == 0);
         }
 
+        // Get the hero at position h of the ascending order
+        MonsterIndex getHero(const int h) const {
+            return (MonsterIndex) (this->heroes >> (8 * h));
+        }
+
+        // True if hero is part of the army. Compares all used bytes of heroes at once: a byte becomes 0 exactly where it matches
+        bool hasHero(const MonsterIndex hero) const {
+            const uint64_t LOW_BITS = 0x0101010101010101ULL;
+            const uint64_t HIGH_BITS = 0x8080808080808080ULL;
+            const uint64_t difference = this->heroes ^ (LOW_BITS * hero);
+            const uint64_t usedBytes = ((uint64_t) 1 << (8 * this->heroAmount)) - 1;
+            // A borrow can only mark a byte above a real match, so a mark in a used byte always means a match
+            return ((difference - LOW_BITS) & ~difference & HIGH_BITS & usedBytes) != 0;
+        }
+
         std::string toString();
         std::string toJSON();
+
+    private:
+        // Insert hero into heroes behind all smaller ones
+        void addHero(const MonsterIndex hero) {
+            int smaller = 0;
+            while (smaller < this->heroAmount && this->getHero(smaller) < hero) {
+                smaller++;
+            }
+            const uint64_t lowerBytes = ((uint64_t) 1 << (8 * smaller)) - 1;
+            this->heroes = (this->heroes & lowerBytes) | ((uint64_t) hero << (8 * smaller)) | ((this->heroes & ~lowerBytes) << 8);
+            this->heroAmount++;
+        }
 };
 const size_t ARMY_BUFFER_MAX_SIZE = GIGABYTE / sizeof(Army);
 
+// An army stored as the unit it appended to an army one smaller, together with the result of its own fight.
+// Storing whole armies repeats the lineup of the parent in every child, this only stores what the child adds
+struct ArmyNode {
+    FightResult lastFightData;
+    FollowerCount followerCost;
+    uint32_t parent;        // Index of the parent in the level before, ArmyTree::HERO_ARMY is set if it is a hero army
+    uint32_t snapshot;
+    MonsterIndex monster;   // Unit appended to the parent
+};
+
+// Map a new file with room for bytes in directory into memory. The file is removed right away and vanishes once it is unmapped.
+// Its blocks are reserved up front, so writing to the mapping can't fail on a full disk. Returns nullptr if that fails or isn't supported
+void * mapSpillFile(const size_t bytes, const std::string & directory);
+void unmapSpillFile(void * mapping, const size_t bytes);
+
+// Storage for the ArmyNodes of one kind of a level, used like a vector. The nodes are either kept in memory or in a spill file
+// that is mapped into memory, so levels larger than the memory can be paged to disk. Every pass over a level reads and writes it
+// mostly in order, the system's read-ahead and write-back keep up with that on a fast disk.
+// Spill files are removed as soon as they are created and vanish with the buffer or the process
+class ArmyNodeBuffer {
+    public:
+        ArmyNodeBuffer();
+        ArmyNodeBuffer(ArmyNodeBuffer && other);
+        ArmyNodeBuffer(const ArmyNodeBuffer &) = delete;
+        ArmyNodeBuffer & operator=(const ArmyNodeBuffer &) = delete;
+        ~ArmyNodeBuffer();
+
+        // Make room for at least amount nodes
+        void reserve(const size_t amount);
+        // Make room for amount nodes in a spill file in directory. Returns false if mapping a file failed or isn't supported, the buffer is unchanged then
+        bool reserveSpilled(const size_t amount, const std::string & directory);
+        // Keep only the first amount nodes
+        void truncate(const size_t amount) {
+            this->used = std::min(amount, this->used);
+        }
+
+        void emplace_back() {
+            if (this->used == this->capacity) {
+                const size_t newCapacity = std::max(2 * this->capacity, (size_t) 16);
+                if (!this->allocate(newCapacity, this->spillDirectory)) {
+                    this->allocate(newCapacity, ""); // The spill file can't grow, keep the nodes in memory instead
+                }
+            }
+            this->nodes[this->used++] = ArmyNode();
+        }
+
+        size_t size() const {
+            return this->used;
+        }
+        bool isSpilled() const {
+            return !this->spillDirectory.empty();
+        }
+        // Memory taken by nodes that are not in a spill file
+        size_t getMemoryUsage() const {
+            return this->isSpilled() ? 0 : this->capacity * sizeof(ArmyNode);
+        }
+
+        ArmyNode & operator[](const size_t i) {
+            return this->nodes[i];
+        }
+        const ArmyNode & operator[](const size_t i) const {
+            return this->nodes[i];
+        }
+        ArmyNode & back() {
+            return this->nodes[this->used - 1];
+        }
+        ArmyNode * begin() {
+            return this->nodes;
+        }
+        ArmyNode * end() {
+            return this->nodes + this->used;
+        }
+
+    private:
+        ArmyNode * nodes;
+        size_t used;
+        size_t capacity;
+        std::string spillDirectory; // Empty if the nodes are kept in memory
+
+        // Move the nodes to new storage for capacity nodes, in a spill file if directory isn't empty
+        bool allocate(const size_t newCapacity, const std::string & directory);
+        void release();
+};
+
+// The armies of one size, split like the solver splits them
+struct ArmyLevel {
+    ArmyNodeBuffer pureArmies;
+    ArmyNodeBuffer heroArmies;
+};
+
+// Armies of all sizes that are still needed, stored as a prefix tree. levels[s] holds the armies of size s + 1.
+// Only the armies of one level can be changed at a time, the armies of the levels before are the parents that reconstruct them
+class ArmyTree {
+    public:
+        static const uint32_t HERO_ARMY = 1u << 31;     // Set in indices of hero armies
+        static const uint32_t NO_PARENT = 0xFFFFFFFF;   // Parent of armies of size 1
+
+        std::vector<ArmyLevel> levels;
+
+        ArmyNodeBuffer & getArmies(const size_t level, const uint32_t flag) {
+            return (flag & HERO_ARMY) ? this->levels[level].heroArmies : this->levels[level].pureArmies;
+        }
+        const ArmyNodeBuffer & getArmies(const size_t level, const uint32_t flag) const {
+            return (flag & HERO_ARMY) ? this->levels[level].heroArmies : this->levels[level].pureArmies;
+        }
+        const ArmyNode & getNode(const size_t level, const uint32_t index) const {
+            return this->getArmies(level, index)[index & ~HERO_ARMY];
+        }
+
+        // Memory taken by the armies of all levels, spilled ones excluded
+        size_t getMemoryUsage() const {
+            size_t bytes = 0;
+            for (size_t level = 0; level < this->levels.size(); level++) {
+                bytes += this->levels[level].pureArmies.getMemoryUsage() + this->levels[level].heroArmies.getMemoryUsage();
+            }
+            return bytes;
+        }
+};
+
+// Reconstructs armies stored in an ArmyTree. The last army read of every level is kept, so reading a level in order
+// costs about one copy per army. Not thread safe, every thread needs its own reader
+class ArmyTreeReader {
+    public:
+        ArmyTreeReader(const ArmyTree & aTree);
+
+        // Get the army at index of level. The reference stays valid until the next army of that level is read
+        const Army & get(const size_t level, const uint32_t index);
+
+    private:
+        const ArmyTree & tree;
+        Army armies[ARMY_MAX_SIZE];
+        uint32_t indices[ARMY_MAX_SIZE];
+};
+
+// The armies of one level of an ArmyTree, read like a vector of armies
+class ArmyLevelView {
+    public:
+        ArmyLevelView(ArmyTreeReader & aReader, const ArmyTree & tree, const size_t aLevel, const uint32_t aFlag) :
+            reader(aReader),
+            level(aLevel),
+            flag(aFlag),
+            amount(tree.getArmies(aLevel, aFlag).size())
+        {}
+
+        size_t size() const {
+            return this->amount;
+        }
+        const Army & operator[](const size_t i) const {
+            return this->reader.get(this->level, (uint32_t) i | this->flag);
+        }
+
+    private:
+        ArmyTreeReader & reader;
+        size_t level;
+        uint32_t flag;
+        size_t amount;
+};
+
 // An instance to be solved by the program
+// Everything about a target that does not depend on the army fighting it.
+// Compiled once per instance so simulateFight doesn't have to recompute it every turn of billions of fights.
+struct TargetProfile {
+    // Totals of all globally triggering skills for every possible amount of monsters lost.
+    // Only valid as long as no monster behind the frontliner died, because dead monsters lose their skill
+    int protection[ARMY_MAX_SIZE];
+    int buffDamage[ARMY_MAX_SIZE];
+    int aoeDamage[ARMY_MAX_SIZE];
+    int healing[ARMY_MAX_SIZE];
+    double dampFactor[ARMY_MAX_SIZE];
+    double absorbMult[ARMY_MAX_SIZE];
+
+    int64_t turnSeeds[TURN_LIMIT];  // Seed the opponent's LUX and CRIT skills use in every turn
+
+    bool hasDice;                   // DICE max health bonus depends on the opponent and has to be applied in every fight
+    bool hasBeerHealths;            // Only true if beerHealths can be used
+    int64_t beerHealths[ARMY_MAX_SIZE][ARMY_MAX_SIZE]; // Max healths of the target after the opponent's BEER for every opponent size
+
+    void compile(const Army & target);
+};
+
 struct Instance {
     Army target;
+    TargetProfile targetProfile; // Compiled from target in setTarget
     size_t targetSize;
     size_t maxCombatants; // Used for Quest Difficulties
 
@@ -268,6 +505,8 @@ struct Instance {
     // Stats for Benchmarking
     time_t calculationTime;
     int totalFightsSimulated = 0;
+    int64_t memoLookups = 0;    // Resumed fights that could be looked up in the SuffixMemo
+    int64_t memoHits = 0;
 
     // Propagates from Hero Abilities
     bool hasAoe;
@@ -276,6 +515,8 @@ struct Instance {
     bool hasBeer;
     bool hasGambler;
     bool hasWorldBoss;
+    bool hasSkills;         // False if the target consists of normal monsters only
+    unsigned fightFeatures; // FightFeatures of all fights while solving. Narrowed down to the available monsters by the solver
     int64_t lowestBossHealth;
 
     std::vector<bool> monsterUsefulLast;
@@ -290,21 +531,21 @@ inline bool hasFewerFollowers(const Army & a, const Army & b) {
 }
 
 // Function for sorting armies to place better results first, then sorting by army strength for equal results
-inline bool isMoreEfficient(const Army & a, const Army & b) {
-    if (a.lastFightData.monstersLost != b.lastFightData.monstersLost) {
-        return a.lastFightData.monstersLost > b.lastFightData.monstersLost;
+inline bool isMoreEfficient(const FightResult & a, const int64_t strengthA, const FightResult & b, const int64_t strengthB) {
+    if (a.monstersLost != b.monstersLost) {
+        return a.monstersLost > b.monstersLost;
     }
-    else if (a.lastFightData.frontHealth != b.lastFightData.frontHealth) {
-        return a.lastFightData.frontHealth > b.lastFightData.frontHealth;
+    else if (a.frontHealth != b.frontHealth) {
+        return a.frontHealth > b.frontHealth;
     }
-    else if (a.lastFightData.rightAoeDamage != b.lastFightData.rightAoeDamage) {
-        return a.lastFightData.rightAoeDamage > b.lastFightData.rightAoeDamage;
+    else if (a.rightAoeDamage != b.rightAoeDamage) {
+        return a.rightAoeDamage > b.rightAoeDamage;
     }
-    else if (a.lastFightData.leftAoeDamage != b.lastFightData.leftAoeDamage) {
-        return a.lastFightData.leftAoeDamage < b.lastFightData.leftAoeDamage;
+    else if (a.leftAoeDamage != b.leftAoeDamage) {
+        return a.leftAoeDamage < b.leftAoeDamage;
     }
     else {
-        return a.strength < b.strength;
+        return strengthA < strengthB;
     }
 }
 
@@ -319,9 +560,17 @@ MonsterIndex addLeveledHero(Monster & hero, int level);
 // Returns the index of a quest if the lineup is the same. Returns -1 if not a quest
 int isQuest(Army & army);
 
+// Get the FightFeatures a monster brings into every fight it takes part in
+unsigned getFightFeatures(const Monster & monster);
+
 // Custom ceil function to avoid excessive casting. Hardcoded to be effective on 32bit ints
 inline int castCeil(double f) {
     return 2147483647 - (int)(2147483647.0 - f);
 }
 
+// Seed the LUX and CRIT skills of an army's opponent use in a turn
+inline int64_t calculateTurnSeed(const int64_t seed, const int turncounter) {
+    return (seed + (101 - turncounter)*(101 - turncounter)*(101 - turncounter)) % (int64_t)round((double)seed / (101 - turncounter) + (101 - turncounter)*(101 - turncounter));
+}
+
 #endif
@@ -173,6 +173,16 @@ void IOManager::getConfiguration() {
                         config.showReplayStrings = parseBool(tokens.at(1));
                     } else if (tokens[0] == TOKENS.IGNORE_EXEC_HALT) {
                         config.ignoreExecutionHalt = parseBool(tokens.at(1));
+                    } else if (tokens[0] == TOKENS.THREADS) {
+                        config.threads = (size_t) max((int64_t) 0, parseInt(tokens.at(1)));
+                    } else if (tokens[0] == TOKENS.SNAPSHOT_MEMORY) {
+                        config.snapshotMemory = (size_t) max((int64_t) 0, parseInt(tokens.at(1)));
+                    } else if (tokens[0] == TOKENS.MEMO_MEMORY) {
+                        config.memoMemory = (size_t) max((int64_t) 0, parseInt(tokens.at(1)));
+                    } else if (tokens[0] == TOKENS.COST_ORDERED_MEMORY) {
+                        config.costOrderedMemory = (size_t) max((int64_t) 0, parseInt(tokens.at(1)));
+                    } else if (tokens[0] == TOKENS.MEMORY_BUDGET) {
+                        config.memoryBudget = (size_t) max((int64_t) 0, parseInt(tokens.at(1)));
                     } else if (tokens[0] != TOKENS.EMPTY) {
                         interface.outputMessage("Unrecognized option '" + tokens[0] + "'", NOTIFICATION_OUTPUT);
                     }
@@ -516,6 +526,9 @@ string makeStringFromInstance(Instance instance, bool valid, bool showReplayStri
         s << "  Boss Damage Done: " << numberWithSeparators(WORLDBOSS_HEALTH - instance.lowestBossHealth) << endl;
     }
     s << "  " << instance.totalFightsSimulated << " Fights simulated." << endl;
+    if (instance.memoLookups > 0) {
+        s << "  " << instance.memoHits * 100 / instance.memoLookups << "% of " << instance.memoLookups << " resumed Fights found in the memo." << endl;
+    }
     s << "  Total Calculation Time: " << instance.calculationTime << endl;
     s << "  Calc Version: " << VERSION << endl << endl;
 
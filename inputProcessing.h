@@ -64,6 +64,11 @@ struct ParserTokens {
     const std::string SHOW_REPLAY_STRINGS = "show_replays";
     const std::string IGNORE_EMPTY =        "ignore_empty_lines";
     const std::string IGNORE_EXEC_HALT =    "ignore_exec_halt";
+    const std::string THREADS =             "threads";
+    const std::string SNAPSHOT_MEMORY =     "snapshot_memory";
+    const std::string MEMO_MEMORY =         "memo_memory";
+    const std::string COST_ORDERED_MEMORY = "cost_ordered_memory";
+    const std::string MEMORY_BUDGET =       "memory_budget";
 
     const std::string T_SOLUTION_OUTPUT =   "solution";
     const std::string T_BASIC_OUTPUT =      "basic";
@@ -84,7 +89,13 @@ struct Configuration {
     bool individualBattles = false; //
     bool unlimitedWorldbossHealth = false; //
 
-    size_t branchwiseExpansionLimit = 20;
+    size_t branchwiseExpansionLimit = 20; // Most armies per packet when army sizes are expanded depth-first
+    size_t threads = 0; // Number of threads used for simulating fights. 0 uses all cores
+    size_t snapshotMemory = 256; // Megabytes used to store fight states that don't fit into FightResults. 0 disables them
+    size_t memoMemory = 64; // Megabytes used to remember the outcomes of resumed fights. 0 disables the memo
+    size_t costOrderedMemory = 0; // Megabytes the cost ordered search may use before the level search takes over. 0 disables it
+    size_t memoryBudget = 0; // Megabytes the level search may use, snapshots and memo included. Larger sizes are expanded depth-first to stay below. 0 means no limit
+    std::string spillDirectory = ""; // Directory for spill files of levels that exceed memoryBudget. Empty expands those depth-first instead. Only set with -spill, config values are lowercased
 };
 extern Configuration config;
 
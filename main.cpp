@@ -4,59 +4,817 @@
 #include <algorithm>
 #include <ctime>
 #include <limits>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <queue>
+#include <atomic>
+#include <mutex>
 
 #include "inputProcessing.h"
 #include "cosmosData.h"
 #include "battleLogic.h"
+#include "workerPool.h"
 
 using namespace std;
 
 IOManager iomanager;
 
-// Simulates fights with all armies against the target. The FightResults are written to the corresponding structs in armies.
-// If a solution is found, armies that are more expensive than that solution are ignored
-void simulateMultipleFights(vector<Army> & armies, Instance & instance) {
-    bool newFound = false;
-    size_t armyAmount = armies.size();
+// Amount of armies a worker claims at once when fights are simulated in parallel
+const size_t FIGHT_CHUNK_SIZE = 4096;
 
-    if (!instance.hasWorldBoss) {
-        for (size_t i = 0; i < armyAmount; i++) {
-            if (armies[i].followerCost < instance.followerUpperBound) { // Ignore if a cheaper solution exists
-                if (simulateFight(armies[i], instance.target)) {  // left (our side) wins:
-                    if (!newFound) {
-                        interface.suspendTimedOutputs(DETAILED_OUTPUT);
+// Packets the streaming expansion tries to give every worker, so idle workers can steal from busy ones
+const size_t PACKETS_PER_WORKER = 16;
+
+// Memory the FinalSlotIndex of every worker may use for the thresholds it measured
+const size_t FINAL_SLOT_INDEX_MEMORY = 8 * MEGABYTE;
+
+// Dominance gathers and sweeps the armies of a level in batches of about 1 / DOMINANCE_BATCHES of them, one after another
+const size_t DOMINANCE_BATCHES = 4;
+
+// One FightContext per worker thread of the workerPool
+vector<FightContext> fightContexts;
+
+// Armies of the chunk every worker simulates in simulateMultipleFights. Kept between levels to reuse their memory
+vector<vector<Army>> fightChunks;
+
+// FightSnapshots of the last two army sizes. Fights of armies with size s store theirs in levelSnapshots[s % 2]
+SnapshotStore levelSnapshots[2];
+
+// Outcomes of resumed fights against the current target, shared by all workers
+SuffixMemo suffixMemo;
+
+// The best solution found by concurrently running workers.
+// Solutions are ranked by followerCost first and by their position in the serial order second. Both are packed into one atomic key,
+// so workers can prune against the best known follower count without locking and the result does not depend on thread timing.
+// Positions are limited to 32 bit, far more armies than fit into memory.
+class Incumbent {
+    private:
+        atomic<uint64_t> key;
+        mutex lock;
+        uint64_t storedKey; // Key belonging to best
+        Army best;
+        bool found;
+
+        static uint64_t makeKey(FollowerCount followerCost, uint32_t position) {
+            return ((uint64_t) followerCost << 32) | position;
+        }
+
+    public:
+        Incumbent(FollowerCount followerUpperBound) :
+            key(makeKey(followerUpperBound, 0)),
+            storedKey(makeKey(followerUpperBound, 0)),
+            found(false) {}
+
+        // Check if an army would replace the current solution if it wins. Lock free
+        bool isImprovedBy(FollowerCount followerCost, uint32_t position) const {
+            return makeKey(followerCost, position) < this->key.load(memory_order_relaxed);
+        }
+
+        // Submit an army that won its fight
+        void offer(const Army & army, uint32_t position) {
+            uint64_t newKey = makeKey(army.followerCost, position);
+            uint64_t currentKey = this->key.load();
+            while (newKey < currentKey) {
+                if (this->key.compare_exchange_weak(currentKey, newKey)) {
+                    lock_guard<mutex> guard(this->lock);
+                    if (newKey < this->storedKey) { // Another thread might have stored an even better army in the meantime
+                        this->storedKey = newKey;
+                        this->best = army;
+                        this->found = true;
                     }
-                    newFound = true;
-                    instance.followerUpperBound = armies[i].followerCost;
-                    instance.bestSolution = armies[i];
-                    interface.outputMessage(instance.bestSolution.toString(), DETAILED_OUTPUT, 2);
+                    return;
                 }
             }
         }
-        if (newFound) {
-            interface.resumeTimedOutputs(DETAILED_OUTPUT);
+
+        FollowerCount followerUpperBound() const { return (FollowerCount) (this->key.load(memory_order_relaxed) >> 32); }
+        bool hasSolution() const { return this->found; }
+        const Army & bestSolution() const { return this->best; }
+
+        // Write the solution into the instance if one was found
+        void applyTo(Instance & instance) const {
+            if (this->found) {
+                instance.followerUpperBound = this->best.followerCost;
+                instance.bestSolution = this->best;
+                interface.suspendTimedOutputs(DETAILED_OUTPUT);
+                interface.outputMessage(instance.bestSolution.toString(), DETAILED_OUTPUT, 2);
+                interface.resumeTimedOutputs(DETAILED_OUTPUT);
+            }
         }
-    } else {
-        for (size_t i = 0; i < armyAmount; i++) {
-            simulateFight(armies[i], instance.target);
-            if ( //instance.lowestBossHealth == -1 ||
-                armies[i].lastFightData.frontHealth < instance.lowestBossHealth) {
-                instance.bestSolution = armies[i];
-                instance.lowestBossHealth = armies[i].lastFightData.frontHealth;
-            }
-            else if (armies[i].lastFightData.frontHealth > 0) { // reached the limit
-                instance.bestSolution = armies[i];
+};
+
+// Worldboss results of a consecutive part of the simulated armies.
+// Merging the records of all parts in order gives the same outcome as comparing all armies in one serial loop
+class BossFightRecord {
+    public:
+        bool found = false;
+        DamageType lowestBossHealth;
+        Army best;                  // First army that left the boss with lowestBossHealth
+        bool limitReached = false;
+        Army limitArmy;             // Last army whose damage reached the limit of DamageType
+
+        void add(const Army & army) {
+            if (army.lastFightData.frontHealth > 0) { // reached the limit
+                this->limitReached = true;
+                this->limitArmy = army;
+            } else if (!this->found || army.lastFightData.frontHealth < this->lowestBossHealth) {
+                this->found = true;
+                this->lowestBossHealth = army.lastFightData.frontHealth;
+                this->best = army;
+            }
+        }
+
+        // Append the results of a later part
+        void merge(const BossFightRecord & later) {
+            if (later.limitReached) {
+                this->limitReached = true;
+                this->limitArmy = later.limitArmy;
+            }
+            if (later.found && (!this->found || later.lowestBossHealth < this->lowestBossHealth)) {
+                this->found = true;
+                this->lowestBossHealth = later.lowestBossHealth;
+                this->best = later.best;
+            }
+        }
+
+        void applyTo(Instance & instance) const {
+            if (this->limitReached) {
+                instance.bestSolution = this->limitArmy;
                 instance.lowestBossHealth = numeric_limits<DamageType>::min();
+            } else if (this->found && this->lowestBossHealth < instance.lowestBossHealth) {
+                instance.bestSolution = this->best;
+                instance.lowestBossHealth = this->lowestBossHealth;
+            }
+        }
+};
+
+// Set where the fights of every worker store their snapshots and where they find the snapshots of the armies' lastFightData
+void setSnapshotStores(SnapshotStore * snapshots, const SnapshotStore * parentSnapshots) {
+    for (size_t i = 0; i < fightContexts.size(); i++) {
+        fightContexts[i].snapshots = snapshots;
+        fightContexts[i].parentSnapshots = parentSnapshots;
+    }
+}
+
+// Move the fight counts of all worker contexts into the statistics of the instance
+void collectFightCounts(Instance & instance) {
+    for (size_t i = 0; i < fightContexts.size(); i++) {
+        instance.totalFightsSimulated += fightContexts[i].fightsSimulated;
+        instance.memoLookups += fightContexts[i].memoLookups;
+        instance.memoHits += fightContexts[i].memoHits;
+        fightContexts[i].fightsSimulated = 0;
+        fightContexts[i].memoLookups = 0;
+        fightContexts[i].memoHits = 0;
+    }
+}
+
+// Simulates armies[begin, end) against the target and offers every winner to the incumbent. position(i) is the rank of armies[i] in the serial order.
+// Consecutive armies continuing from the same FightResult are simulated together if the target allows it.
+// Their results are only written back if the army would have been simulated on its own, so pruning stays exactly the same as in a serial loop.
+template <class Position>
+void simulateFightRange(vector<Army> & armies, size_t begin, size_t end, Instance & instance,
+                        Incumbent & incumbent, FightContext & context, Position position) {
+    bool batchable = !instance.hasSkills && !instance.hasWorldBoss;
+    SiblingFights & siblings = context.siblingFights;
+    const Army * lanes[SIBLING_BATCH_SIZE];
+    size_t laneIndices[SIBLING_BATCH_SIZE];
+    int laneAmount;
+    size_t i = begin;
+    size_t j;
+
+    while (i < end) {
+        if (!incumbent.isImprovedBy(armies[i].followerCost, position(i))) { // Ignore if a cheaper solution exists
+            i++;
+        } else if (!batchable || !SiblingFights::canSimulate(armies[i], instance.target)) {
+            if (simulateFight(armies[i], instance, context)) {  // left (our side) wins:
+                incumbent.offer(armies[i], position(i));
+            }
+            i++;
+        } else {
+            // Gather siblings. Armies that are already too expensive will never be simulated and are left out
+            laneAmount = 0;
+            for (j = i; j < end && laneAmount < SIBLING_BATCH_SIZE &&
+                        SiblingFights::canSimulate(armies[j], instance.target) && SiblingFights::areSiblings(armies[i], armies[j]); j++) {
+                if (incumbent.isImprovedBy(armies[j].followerCost, position(j))) {
+                    lanes[laneAmount] = &armies[j];
+                    laneIndices[laneAmount] = j;
+                    laneAmount++;
+                }
+            }
+            siblings.simulate(lanes, laneAmount, instance.target);
+            for (int l = 0; l < laneAmount; l++) {
+                if (incumbent.isImprovedBy(armies[laneIndices[l]].followerCost, position(laneIndices[l]))) {
+                    context.fightsSimulated++;
+                    armies[laneIndices[l]].lastFightData = siblings.results[l];
+                    if (siblings.leftWins[l]) {
+                        incumbent.offer(armies[laneIndices[l]], position(laneIndices[l]));
+                    }
+                }
+            }
+            i = j;
+        }
+    }
+}
+
+// Simulates fights with all armies of a level of tree against the target. The FightResults are written back to the stored armies.
+// If a solution is found, armies that are more expensive than that solution are ignored
+// The armies are split into chunks that are processed by all threads of the workerPool. Each worker reconstructs the armies of its chunk.
+void simulateMultipleFights(ArmyTree & tree, const size_t level, const uint32_t flag, Instance & instance) {
+    ArmyNodeBuffer & nodes = tree.getArmies(level, flag);
+    size_t armyAmount = nodes.size();
+    size_t chunkAmount = (armyAmount + FIGHT_CHUNK_SIZE - 1) / FIGHT_CHUNK_SIZE;
+    auto readChunk = [&] (size_t worker, size_t chunkBegin, size_t chunkEnd) -> vector<Army> & {
+        ArmyTreeReader reader(tree);
+        vector<Army> & armies = fightChunks[worker];
+        armies.clear();
+        for (size_t i = chunkBegin; i < chunkEnd; i++) {
+            armies.push_back(reader.get(level, (uint32_t) i | flag));
+        }
+        return armies;
+    };
+    auto writeChunk = [&] (const vector<Army> & armies, size_t chunkBegin) {
+        for (size_t i = 0; i < armies.size(); i++) {
+            nodes[chunkBegin + i].lastFightData = armies[i].lastFightData;
+            nodes[chunkBegin + i].snapshot = armies[i].snapshot;
+        }
+    };
+
+    if (!instance.hasWorldBoss) {
+        Incumbent incumbent(instance.followerUpperBound);
+        workerPool.run(chunkAmount, [&] (size_t worker, size_t chunk) {
+            size_t chunkBegin = chunk * FIGHT_CHUNK_SIZE;
+            size_t chunkEnd = min(armyAmount, chunkBegin + FIGHT_CHUNK_SIZE);
+            vector<Army> & armies = readChunk(worker, chunkBegin, chunkEnd);
+            simulateFightRange(armies, 0, armies.size(), instance, incumbent, fightContexts[worker],
+                               [chunkBegin] (size_t i) { return (uint32_t) (chunkBegin + i); });
+            writeChunk(armies, chunkBegin);
+        });
+        incumbent.applyTo(instance);
+    } else {
+        // One record per chunk, merged in order to get the same solution regardless of which thread simulated what
+        vector<BossFightRecord> records(chunkAmount);
+        workerPool.run(chunkAmount, [&] (size_t worker, size_t chunk) {
+            size_t chunkBegin = chunk * FIGHT_CHUNK_SIZE;
+            size_t chunkEnd = min(armyAmount, chunkBegin + FIGHT_CHUNK_SIZE);
+            vector<Army> & armies = readChunk(worker, chunkBegin, chunkEnd);
+            for (size_t i = 0; i < armies.size(); i++) {
+                simulateFight(armies[i], instance, fightContexts[worker]);
+                records[chunk].add(armies[i]);
+            }
+            writeChunk(armies, chunkBegin);
+        });
+        for (size_t i = 1; i < chunkAmount; i++) {
+            records[0].merge(records[i]);
+        }
+        if (chunkAmount > 0) {
+            records[0].applyTo(instance);
+        }
+    }
+    collectFightCounts(instance);
+}
+
+// Decides if the FightResult of an army is still exact after a monster is added to its back.
+// A resumed fight starts when the last monster of the old army died. Anything the new monster changed while it waited
+// in the back, and anything neither the FightResult nor its FightSnapshot capture, forces a full simulation.
+class ResumeCheck {
+    private:
+        const Instance & instance;
+        bool targetInvalid;         // Nothing can resume against this target
+        bool targetHasAoe;
+
+        bool invalid;               // Nothing can resume after the current army
+        bool friends;               // A FRIENDS monster would profit from another monster without skill
+        int elements;               // Elements in the army as bitmask
+        int rainbowMissing;         // Elements completing the condition of a RAINBOW monster
+        bool rainbowOpen;           // The free slots could still complete the condition of a RAINBOW monster
+
+    public:
+        ResumeCheck(const Instance & anInstance, const size_t armySize);
+
+        // Gather everything about an army that decides which additions can resume its fight
+        void setArmy(const Army & army);
+
+        // Check if the FightResult of the current army stays exact if monster is added
+        bool allows(const Monster & monster) const;
+
+        // Check if the FightResult of the current army stays exact if any normal monsters are added, up to the largest army
+        bool allowsNormalMonsters() const;
+
+        // Check if monster is allowed after every army that allows normal monsters, and keeps allowing them behind it
+        bool keepsAllowing(const Monster & monster) const;
+};
+
+ResumeCheck::ResumeCheck(const Instance & anInstance, const size_t armySize) :
+    instance(anInstance)
+{
+    // Enemy booze depends on the size of the army. LUX, CRIT and DICE depend on its seed, simulateFight checks if they repeat
+    // Asymmetric aoe of the target would hit a new monster differently than the rest of the army
+    this->targetInvalid = instance.hasAsymmetricAoe || (instance.hasBeer && armySize >= instance.targetSize);
+    this->targetHasAoe = instance.hasAoe;
+}
+
+void ResumeCheck::setArmy(const Army & army) {
+    int behind = 0;
+
+    this->invalid = this->targetInvalid || army.snapshot == MISSING_SNAPSHOT;
+    this->friends = false;
+    this->rainbowMissing = 0;
+    this->rainbowOpen = false;
+    const int freeSlots = (int) this->instance.maxCombatants - army.monsterAmount;
+    for (int m = army.monsterAmount - 1; m >= 0; m--) {
+        const Monster & monster = monsterReference[army.monsters[m]];
+        this->invalid |= monster.skill.skillType == BEER;
+        this->friends |= monster.skill.skillType == FRIENDS;
+        if (monster.skill.skillType == RAINBOW) {
+            const int missing = VALID_RAINBOW_CONDITION & ~behind;
+            if (missing != 0 && (missing & (missing - 1)) == 0) {
+                this->rainbowMissing |= missing;
+            }
+            // Monsters added later go behind it, one element per slot
+            int missingAmount = 0;
+            for (int element = missing; element != 0; element &= element - 1) {
+                missingAmount++;
             }
+            this->rainbowOpen |= missing != 0 && missingAmount <= freeSlots;
+        }
+        behind |= 1 << monster.element;
+    }
+    this->elements = behind;
+}
+
+bool ResumeCheck::allows(const Monster & monster) const {
+    const HeroSkill & skill = monster.skill;
+    if (this->invalid) {
+        return false;
+    }
+    switch (skill.skillType) {
+        case BUFF:
+        case PROTECT:
+        case CHAMPION:  // Only matters if any monster of the army had the targeted element
+            if (skill.target == ALL || (this->elements & (1 << skill.target))) {
+                return false;
+            } break;
+        case DAMPEN:    if (this->targetHasAoe) {
+                            return false;
+                        } break;
+        case NOTHING:   if (this->friends) {
+                            return false;
+                        } break;
+        default:        if (skill.violatesFightResults) {
+                            return false;
+                        } break;
+    }
+    return (this->rainbowMissing & (1 << monster.element)) == 0;
+}
+
+bool ResumeCheck::allowsNormalMonsters() const {
+    return !this->invalid && !this->friends && !this->rainbowOpen;
+}
+
+bool ResumeCheck::keepsAllowing(const Monster & monster) const {
+    const SkillType skillType = monster.skill.skillType;
+    return !monster.skill.violatesFightResults && !(skillType == DAMPEN && this->targetHasAoe) &&
+           skillType != FRIENDS && skillType != RAINBOW;
+}
+
+// Bounds how many turns a fight can go on after some units are added behind an army that lost all of its monsters.
+// Reaching TURN_LIMIT counts as a win against any target but a worldboss. An army leaving more health on the target's front can win
+// by surviving until then, where an army that kills the front sooner meets the next target monster and loses.
+// Every rule expecting less front health to never hurt only holds for fights that are decided before the limit.
+class FightLengthBound {
+    private:
+        vector<int> unitLives;      // [target monsters lost] Most turns any of the units survives in front, TURN_LIMIT if unbounded
+        vector<int> targetLives;    // [target monsters lost] Most turns the rest of the target survives the units, at most TURN_LIMIT
+
+    public:
+        FightLengthBound() {}   // Bounds no fight
+
+        // Bound fights against the target of instance, which must not be a worldboss, continued by any of units
+        FightLengthBound(const Instance & instance, const vector<MonsterIndex> & units);
+
+        // Check if a fight resumed from state with at most freeSlots of the units ends before TURN_LIMIT
+        bool endsInTime(const FightResult & state, const size_t freeSlots) const;
+};
+
+FightLengthBound::FightLengthBound(const Instance & instance, const vector<MonsterIndex> & units) {
+    const Army & target = instance.target;
+    this->unitLives.assign(target.monsterAmount + 1, 0);
+    vector<int> leastDamages(target.monsterAmount, numeric_limits<int>::max()); // Least damage the units deal to each target monster
+    for (size_t u = 0; u < units.size(); u++) {
+        const Monster & unit = monsterReference[units[u]];
+        bool keepsAlive;
+        switch (unit.skill.skillType) {
+            case PROTECT:
+            case PROTECT_L:
+            case CHAMPION:
+            case CHAMPION_L:
+            case HEAL:
+            case HEAL_L:
+            case LIFESTEAL:
+            case LIFESTEAL_L:
+            case ABSORB:
+            case DICE:  keepsAlive = true; // Keeps its army alive for longer than its health
+                        break;
+            default:    keepsAlive = false;
         }
+        // Least damage the unit takes from the target monsters from i on
+        int leastDamage = numeric_limits<int>::max();
+        for (int i = target.monsterAmount - 1; i >= 0; i--) {
+            const Monster & enemy = monsterReference[target.monsters[i]];
+            leastDamage = min(leastDamage, plainDamage(enemy, unit));
+            leastDamages[i] = min(leastDamages[i], plainDamage(unit, enemy));
+            const int64_t life = !keepsAlive && leastDamage > 0 ? ((int64_t) unit.hp + leastDamage - 1) / leastDamage : TURN_LIMIT;
+            this->unitLives[i] = (int) min((int64_t) TURN_LIMIT, max((int64_t) this->unitLives[i], life));
+        }
+    }
+
+    // Skills of the target could protect or heal it
+    this->targetLives.assign(target.monsterAmount + 1, 0);
+    for (int i = target.monsterAmount - 1; i >= 0; i--) {
+        const int64_t health = monsterReference[target.monsters[i]].hp;
+        const int64_t life = !instance.hasSkills && leastDamages[i] > 0 ? (health + leastDamages[i] - 1) / leastDamages[i] : TURN_LIMIT;
+        this->targetLives[i] = (int) min((int64_t) TURN_LIMIT, this->targetLives[i + 1] + life);
     }
 }
 
+bool FightLengthBound::endsInTime(const FightResult & state, const size_t freeSlots) const {
+    if (state.monstersLost >= (int) this->targetLives.size()) {
+        return false; // Nothing is bounded before a target is set
+    }
+    const int64_t unitLives = (int64_t) freeSlots * this->unitLives[state.monstersLost];
+    return state.turncounter + min(unitLives, (int64_t) this->targetLives[state.monstersLost]) < TURN_LIMIT;
+}
+
+// Probe fights only measure thresholds for pruning, they are not part of the search. While a ProbeScope exists, fights on its context
+// store no snapshots because probes are never expanded, leave the memo to real fights and are not counted in the fight statistics
+class ProbeScope {
+    public:
+        ProbeScope(FightContext & aContext) :
+            context(aContext),
+            snapshots(aContext.snapshots),
+            memo(aContext.memo),
+            fightsSimulated(aContext.fightsSimulated),
+            memoLookups(aContext.memoLookups),
+            memoHits(aContext.memoHits)
+        {
+            this->context.snapshots = nullptr;
+            this->context.memo = nullptr;
+        }
+
+        ~ProbeScope() {
+            this->context.snapshots = this->snapshots;
+            this->context.memo = this->memo;
+            this->context.fightsSimulated = this->fightsSimulated;
+            this->context.memoLookups = this->memoLookups;
+            this->context.memoHits = this->memoHits;
+        }
+
+    private:
+        FightContext & context;
+        SnapshotStore * snapshots;
+        SuffixMemo * memo;
+        int fightsSimulated;
+        int memoLookups;
+        int memoHits;
+};
+
+// Finds the cheapest normal monster that wins a resumed fight in the last army slot without trying all of them.
+// Normal monsters have no skill, so one that beats the target's front with some health left also beats it with less,
+// as long as the fight is decided before TURN_LIMIT. States that could reach it are not indexed.
+// For every state of the target apart from the front's health, the most front health each monster still beats is found by binary search.
+// Running maxima of these thresholds in the order of availableMonsters lead to the first winner with another binary search.
+// Measuring a state takes about log2 of the front's health probes per monster, so it is only measured once it was asked for that often.
+// The states are kept up to FINAL_SLOT_INDEX_MEMORY, later states are never measured.
+class FinalSlotIndex {
+    private:
+        typedef tuple<int8_t, int8_t, int8_t, int16_t, int16_t, int16_t> StateKey;
+
+        struct StateThresholds {
+            int queries = 0;
+            bool indexable = true;          // False once a probe reached TURN_LIMIT
+            vector<DamageType> maxima;      // Running maxima of the thresholds, empty until they are measured
+        };
+
+        const Instance & instance;
+        FightContext & context;         // Context of the worker using this index
+        bool enabled;
+        vector<size_t> candidates;      // Positions in availableMonsters of monsters that are useful last
+        FightLengthBound fightLength;   // Bound for fights continued by one of the candidates
+        map<StateKey, StateThresholds> states;
+        size_t memoryUsage = 0;         // Bytes used by states
+
+        // Simulate monster resuming the fight from state with the front's health replaced. Sets reachedTurnLimit if the fight lasted that long
+        bool wins(const FightResult & state, const MonsterIndex monster, const DamageType frontHealth, bool & reachedTurnLimit);
+
+    public:
+        static const int UNKNOWN = -1;
+
+        FinalSlotIndex(const Instance & anInstance, FightContext & aContext);
+
+        // Position in availableMonsters of the first monster winning when added to army, availableMonsters.size() if none wins.
+        // UNKNOWN if army can't be answered by the index and every monster has to be tried
+        int find(const Army & army, const ResumeCheck & resumeCheck);
+};
+
+FinalSlotIndex::FinalSlotIndex(const Instance & anInstance, FightContext & aContext) :
+    instance(anInstance),
+    context(aContext)
+{
+    // The outcome against these targets depends on more than the state in the FightResult
+    this->enabled = !instance.hasWorldBoss && !instance.hasGambler;
+    vector<MonsterIndex> candidateMonsters;
+    for (size_t m = 0; m < availableMonsters.size(); m++) {
+        if (instance.monsterUsefulLast[availableMonsters[m]]) {
+            this->candidates.push_back(m);
+            candidateMonsters.push_back(availableMonsters[m]);
+        }
+    }
+    if (this->enabled) {
+        this->fightLength = FightLengthBound(instance, candidateMonsters);
+    }
+}
+
+bool FinalSlotIndex::wins(const FightResult & state, const MonsterIndex monster, const DamageType frontHealth, bool & reachedTurnLimit) {
+    Army probe({monster});
+    probe.lastFightData = state;
+    probe.lastFightData.frontHealth = frontHealth;
+    probe.lastFightData.valid = true;
+
+    ProbeScope probeScope(this->context);
+    bool won = simulateFight(probe, this->instance, this->context);
+    reachedTurnLimit |= probe.lastFightData.turncounter >= TURN_LIMIT;
+    return won;
+}
+
+int FinalSlotIndex::find(const Army & army, const ResumeCheck & resumeCheck) {
+    const FightResult & state = army.lastFightData;
+    if (!this->enabled || army.snapshot != NO_SNAPSHOT || !resumeCheck.allowsNormalMonsters() || state.monstersLost >= (int) instance.targetSize) {
+        return UNKNOWN;
+    }
+    const DamageType frontMaxHealth = monsterReference[instance.target.monsters[state.monstersLost]].hp;
+    if (state.frontHealth <= 0 || state.frontHealth > frontMaxHealth || !this->fightLength.endsInTime(state, 1)) {
+        return UNKNOWN;
+    }
+    if (this->candidates.empty()) {
+        return (int) availableMonsters.size();
+    }
+
+    const StateKey key(state.monstersLost, state.turncounter, state.berserk, state.rightAoeDamage, state.leftBackDamage, state.leftBackLethal);
+    auto found = this->states.find(key);
+    if (found == this->states.end()) {
+        // A map node holds the key, the thresholds and about four pointers
+        const size_t stateMemory = sizeof(StateKey) + sizeof(StateThresholds) + 4 * sizeof(void *) + this->candidates.size() * sizeof(DamageType);
+        if (this->memoryUsage + stateMemory > FINAL_SLOT_INDEX_MEMORY) {
+            return UNKNOWN;
+        }
+        this->memoryUsage += stateMemory;
+        found = this->states.emplace(key, StateThresholds()).first;
+    }
+    StateThresholds & thresholds = found->second;
+    int probesPerMonster = 0;
+    for (DamageType health = frontMaxHealth; health > 0; health /= 2) {
+        probesPerMonster++;
+    }
+    if (!thresholds.indexable || (thresholds.maxima.empty() && ++thresholds.queries < probesPerMonster)) {
+        return UNKNOWN;
+    }
+
+    bool reachedTurnLimit = false;
+    if (thresholds.maxima.empty()) {
+        DamageType runningMaximum = 0;
+        thresholds.maxima.reserve(this->candidates.size());
+        for (size_t c = 0; c < this->candidates.size() && !reachedTurnLimit; c++) {
+            // Binary search for the most front health the monster beats. Only health above the running maximum matters
+            DamageType lower = runningMaximum;
+            DamageType upper = frontMaxHealth + 1;
+            while (upper - lower > 1) {
+                DamageType middle = lower + (upper - lower) / 2;
+                if (this->wins(state, availableMonsters[this->candidates[c]], middle, reachedTurnLimit)) {
+                    lower = middle;
+                } else {
+                    upper = middle;
+                }
+            }
+            runningMaximum = lower;
+            thresholds.maxima.push_back(runningMaximum);
+        }
+        if (reachedTurnLimit) {
+            thresholds.indexable = false;
+            thresholds.maxima.clear();
+            thresholds.maxima.shrink_to_fit();
+            return UNKNOWN;
+        }
+    }
+
+    const vector<DamageType> & maxima = thresholds.maxima;
+    size_t first = lower_bound(maxima.begin(), maxima.end(), state.frontHealth) - maxima.begin();
+    if (first == maxima.size()) {
+        return (int) availableMonsters.size();
+    }
+    // Verify the answer with the real front health. If the monster loses after all, every monster is tried
+    if (!this->wins(state, availableMonsters[this->candidates[first]], state.frontHealth, reachedTurnLimit) || reachedTurnLimit) {
+        return UNKNOWN;
+    }
+    return (int) this->candidates[first];
+}
+
+// Lower bound on the followers still needed to beat a target without skills.
+// Against such a target a unit whose skill only affects itself kills more target monsters the less health the front it starts against
+// has left, and the fewer turns passed, as long as the fight is decided before TURN_LIMIT. Only armies whose fight ends before it
+// with any of the units are pruned, which holds for the probes as well. frontHealths[i][u][j] is the most front health at which
+// units[u] starting at target monster i still kills j + 1 of them if no turn has passed yet. Every later unit starts against a front
+// that is damaged already, so cheapest[r][i] assumes it is almost dead: at most r units starting at i can't beat the target for less,
+// even if heroes could be used more than once.
+// Together this bounds the cost of finishing an army. If it is unreachable, the free slots can't kill the rest of the target at all.
+// Heroes whose skill helps other units or damages monsters behind the front have no such bound. So the bound only holds for armies
+// that used all of these, whose FightResult stays exact for normal monsters and that left nothing on the target apart from the front's health.
+class CompletionBound {
+    private:
+        static const uint64_t UNREACHABLE = numeric_limits<uint64_t>::max() / 2;
+
+        const Instance * instance = nullptr;
+        bool enabled = false;
+        vector<MonsterIndex> units;                         // Heroes with a bound first, then availableMonsters. Ordered by cost
+        vector<MonsterIndex> unboundedHeroes;               // Available heroes without a bound
+        FightLengthBound fightLength;                       // Bound for fights continued by the units
+        vector<vector<vector<DamageType>>> frontHealths;    // [target monster][unit][kills - 1]
+        vector<vector<uint64_t>> cheapest;                  // [free slots][target monsters lost]
+
+        // Check if the kills of hero only depend on its own fight against a target without skills, and more kills follow from less front health
+        static bool hasBoundedKills(const Monster & hero);
+
+        // Simulate monster starting against target monster i with frontHealth left on it. Returns the amount of target monsters it kills
+        int getKills(const size_t i, const MonsterIndex monster, const DamageType frontHealth, FightContext & context) const;
+
+    public:
+        // Simulate the available units against the target. Needs the FightFeatures of the instance
+        void compute(const Instance & anInstance, FightContext & context);
+
+        // Check if no army expanded from army with freeSlots more monsters can cost less than followerUpperBound.
+        // resumeCheck must be set to army
+        bool prunes(const Army & army, const ResumeCheck & resumeCheck, const size_t freeSlots, const FollowerCount followerUpperBound) const;
+};
+
+bool CompletionBound::hasBoundedKills(const Monster & hero) {
+    switch (hero.skill.skillType) {
+        case NOTHING:
+        case ADAPT:
+        case HATE:
+        case GROW:
+        case WITHER:
+        case COUNTER:
+        case DAMPEN:    // Nothing to dampen without skills on the target
+        case DAMPEN_L:  return true;
+        default:        return false;
+    }
+}
+
+int CompletionBound::getKills(const size_t i, const MonsterIndex monster, const DamageType frontHealth, FightContext & context) const {
+    Army probe({monster});
+    FightResult & state = probe.lastFightData;
+    state.frontHealth = frontHealth;
+    state.leftAoeDamage = 0;
+    state.rightAoeDamage = 0;
+    state.leftBackDamage = 0;
+    state.leftBackLethal = 0;
+    state.berserk = 0;
+    state.monstersLost = (int8_t) i;
+    state.turncounter = 0;
+    state.valid = true;
+    if (simulateFight(probe, *this->instance, context)) {
+        return (int) (this->instance->targetSize - i);
+    }
+    return probe.lastFightData.monstersLost - (int) i;
+}
+
+void CompletionBound::compute(const Instance & anInstance, FightContext & context) {
+    this->instance = &anInstance;
+    this->enabled = !anInstance.hasSkills && !anInstance.hasWorldBoss;
+    this->units.clear();
+    this->unboundedHeroes.clear();
+    this->frontHealths.clear();
+    this->cheapest.clear();
+    if (!this->enabled) {
+        return;
+    }
+    for (size_t h = 0; h < availableHeroes.size(); h++) {
+        if (hasBoundedKills(monsterReference[availableHeroes[h]])) {
+            this->units.push_back(availableHeroes[h]);
+        } else {
+            this->unboundedHeroes.push_back(availableHeroes[h]);
+        }
+    }
+    this->units.insert(this->units.end(), availableMonsters.begin(), availableMonsters.end());
+    this->fightLength = FightLengthBound(anInstance, this->units);
+
+    const size_t targetSize = anInstance.targetSize;
+    ProbeScope probeScope(context);
+    this->frontHealths.assign(targetSize, vector<vector<DamageType>>(this->units.size()));
+    for (size_t i = 0; i < targetSize; i++) {
+        const DamageType frontMaxHealth = monsterReference[anInstance.target.monsters[i]].hp;
+        for (size_t u = 0; u < this->units.size(); u++) {
+            // Binary search for the most front health that still gives each amount of kills, starting from the most kills
+            vector<DamageType> & healths = this->frontHealths[i][u];
+            healths.assign(this->getKills(i, this->units[u], 1, context), 0);
+            for (int k = (int) healths.size() - 1; k >= 0; k--) {
+                DamageType lower = k + 1 < (int) healths.size() ? healths[k + 1] : 1;
+                DamageType upper = frontMaxHealth + 1;
+                while (upper - lower > 1) {
+                    DamageType middle = lower + (upper - lower) / 2;
+                    if (this->getKills(i, this->units[u], middle, context) > k) {
+                        lower = middle;
+                    } else {
+                        upper = middle;
+                    }
+                }
+                healths[k] = lower;
+            }
+        }
+    }
+
+    this->cheapest.assign(anInstance.maxCombatants + 1, vector<uint64_t>(targetSize + 1, UNREACHABLE));
+    this->cheapest[0][targetSize] = 0;
+    for (size_t r = 1; r <= anInstance.maxCombatants; r++) {
+        this->cheapest[r] = this->cheapest[r - 1];
+        for (size_t i = 0; i < targetSize; i++) {
+            for (size_t u = 0; u < this->units.size(); u++) {
+                uint64_t cost = monsterReference[this->units[u]].cost + this->cheapest[r - 1][i + this->frontHealths[i][u].size()];
+                this->cheapest[r][i] = min(this->cheapest[r][i], cost);
+            }
+        }
+    }
+}
+
+bool CompletionBound::prunes(const Army & army, const ResumeCheck & resumeCheck, const size_t freeSlots, const FollowerCount followerUpperBound) const {
+    const FightResult & state = army.lastFightData;
+    if (!this->enabled || !resumeCheck.allowsNormalMonsters() || state.monstersLost >= (int) this->instance->targetSize ||
+        state.rightAoeDamage != 0 || state.leftBackDamage != 0 || state.leftBackLethal != 0 || !this->fightLength.endsInTime(state, freeSlots)) {
+        return false;
+    }
+    for (size_t h = 0; h < this->unboundedHeroes.size(); h++) {
+        if (find(army.monsters, army.monsters + army.monsterAmount, this->unboundedHeroes[h]) == army.monsters + army.monsterAmount) {
+            return false; // The hero costs nothing and could do anything
+        }
+    }
+
+    // Look for a first unit that might still lead to a cheaper solution
+    const uint64_t remainingFollowers = (uint64_t) followerUpperBound - army.followerCost;
+    for (size_t u = 0; u < this->units.size() && monsterReference[this->units[u]].cost < remainingFollowers; u++) {
+        const vector<DamageType> & healths = this->frontHealths[state.monstersLost][u];
+        size_t kills = 0;
+        while (kills < healths.size() && healths[kills] >= state.frontHealth) {
+            kills++;
+        }
+        if (monsterReference[this->units[u]].cost + this->cheapest[freeSlots - 1][state.monstersLost + kills] < remainingFollowers) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Bound for the current target, computed before its armies are expanded
+CompletionBound completionBound;
+
+// Append army with monster added to its back to children. index is the position of army in its level
+void addChild(vector<Army> & children, const Army & army, const uint32_t, const MonsterIndex monster, const ResumeCheck & resumeCheck) {
+    children.push_back(army);
+    children.back().add(monster);
+    children.back().lastFightData.valid = resumeCheck.allows(monsterReference[monster]);
+}
+
+// Only counts the children, so their storage can be allocated at its exact size before they are written
+struct ChildCounter {
+    size_t amount = 0;
+};
+
+void addChild(ChildCounter & children, const Army &, const uint32_t, const MonsterIndex, const ResumeCheck &) {
+    children.amount++;
+}
+
+void addChild(ArmyNodeBuffer & children, const Army & army, const uint32_t index, const MonsterIndex monster, const ResumeCheck & resumeCheck) {
+    children.emplace_back();
+    ArmyNode & child = children.back();
+    child.lastFightData = army.lastFightData;
+    child.lastFightData.valid = resumeCheck.allows(monsterReference[monster]);
+    child.followerCost = army.followerCost + monsterReference[monster].cost;
+    child.parent = index;
+    child.snapshot = army.snapshot;
+    child.monster = monster;
+}
+
 // Take the data from oldArmies and write all armies into newArmies with an additional monster at the end.
-// Armies that are dominated are ignored.
-void expand(vector<Army> & newPureArmies, vector<Army> & newHeroArmies,
-            const vector<Army> & oldPureArmies, const vector<Army> & oldHeroArmies,
-            const size_t currentArmySize, const Instance & instance) {
+// Armies that are dominated are ignored. So are armies that cost at least followerUpperBound, which were never simulated unless the target is a worldboss.
+// Armies that completionBound proves too expensive to finish are ignored too.
+// New armies that cost more than followerUpperBound are ignored.
+// If finalSlot is given and the last slot is filled, normal monsters that lose according to it are left out as well.
+// The old armies are read like a vector of armies, the new ones are written as whole armies or as ArmyNodes of the next level.
+template <class OldArmies, class NewArmies>
+void expand(NewArmies & newPureArmies, NewArmies & newHeroArmies,
+            const OldArmies & oldPureArmies, const OldArmies & oldHeroArmies,
+            const size_t currentArmySize, const Instance & instance, const FollowerCount followerUpperBound,
+            FinalSlotIndex * finalSlot = nullptr) {
 
     FollowerCount remainingFollowers;
     size_t availableMonstersSize = availableMonsters.size();
@@ -64,194 +822,866 @@ void expand(vector<Army> & newPureArmies, vector<Army> & newHeroArmies,
     size_t oldPureArmiesSize = oldPureArmies.size();
     size_t oldHeroArmiesSize = oldHeroArmies.size();
     size_t i, m;
+    size_t monstersBegin, monstersEnd; // Range of availableMonsters that is added
 
     bool removeUseless = currentArmySize == (instance.maxCombatants-1) && !instance.hasWorldBoss;
-    bool instanceInvalid = instance.hasHeal || instance.hasAsymmetricAoe || instance.hasGambler;
+    ResumeCheck resumeCheck(instance, currentArmySize);
 
-    // enemy booze will invalidate FightResults
-    bool boozeInfluence = instance.hasBeer && currentArmySize >= instance.targetSize;
+    auto isExpandable = [&] (const Army & army) {
+        if (army.lastFightData.dominated || !(instance.hasWorldBoss || army.followerCost < followerUpperBound)) {
+            return false;
+        }
+        resumeCheck.setArmy(army);
+        return !completionBound.prunes(army, resumeCheck, instance.maxCombatants - currentArmySize, followerUpperBound);
+    };
+
+    // Only the first winning normal monster can be part of the best solution. Restrict the range to it if the index knows it
+    auto restrictMonsters = [&] (const Army & army) {
+        monstersBegin = 0;
+        monstersEnd = availableMonstersSize;
+        if (removeUseless && finalSlot != nullptr && availableMonstersSize > 0 && monsterReference[availableMonsters[0]].cost <= remainingFollowers) {
+            int first = finalSlot->find(army, resumeCheck);
+            if (first != FinalSlotIndex::UNKNOWN) {
+                monstersBegin = (size_t) first;
+                monstersEnd = min(monstersBegin + 1, availableMonstersSize);
+            }
+        }
+    };
 
     // Expansion for non-Hero Armies
     for (i = 0; i < oldPureArmiesSize; i++) {
-        if (!oldPureArmies[i].lastFightData.dominated) {
-            remainingFollowers = instance.followerUpperBound - oldPureArmies[i].followerCost;
+        const Army & army = oldPureArmies[i];
+        if (isExpandable(army)) {
+            remainingFollowers = followerUpperBound - army.followerCost;
+            restrictMonsters(army);
             // Add Normal Monsters. Check for Cost
-            for (m = 0; m < availableMonstersSize; m++) {
+            for (m = monstersBegin; m < monstersEnd; m++) {
                 if (monsterReference[availableMonsters[m]].cost <= remainingFollowers) {
-                    if (!removeUseless || instance.monsterUsefulLast[availableMonsters[m]] || instance.targetSize == oldPureArmies[i].lastFightData.monstersLost) {
-                        newPureArmies.push_back(oldPureArmies[i]);
-                        newPureArmies.back().add(availableMonsters[m]);
-                        newPureArmies.back().lastFightData.valid = !instanceInvalid && !boozeInfluence;
+                    if (!removeUseless || instance.monsterUsefulLast[availableMonsters[m]] || instance.targetSize == army.lastFightData.monstersLost) {
+                        addChild(newPureArmies, army, (uint32_t) i, availableMonsters[m], resumeCheck);
                     }
                 }
             }
             // Add Hero. no check needed because it is the First Added
             for (m = 0; m < availableHeroesSize; m++) {
-                if (!removeUseless || instance.monsterUsefulLast[availableHeroes[m]] || instance.targetSize == oldPureArmies[i].lastFightData.monstersLost) {
-                    newHeroArmies.push_back(oldPureArmies[i]);
-                    newHeroArmies.back().add(availableHeroes[m]);
-                    newHeroArmies.back().lastFightData.valid = !instanceInvalid &&
-                                                               !boozeInfluence &&
-                                                               !monsterReference[availableHeroes[m]].skill.violatesFightResults;
+                if (!removeUseless || instance.monsterUsefulLast[availableHeroes[m]] || instance.targetSize == army.lastFightData.monstersLost) {
+                    addChild(newHeroArmies, army, (uint32_t) i, availableHeroes[m], resumeCheck);
                 }
             }
         }
     }
 
-    vector<bool> usedHeroes; usedHeroes.resize(monsterReference.size(), false);
-    HeroSkill currentSkill;
-    bool invalidSkill;
-    bool friendsInfluence;
-    bool rainbowInfluence;
     for (i = 0; i < oldHeroArmiesSize; i++) {
-        if (!oldHeroArmies[i].lastFightData.dominated) {
-            remainingFollowers = instance.followerUpperBound - oldHeroArmies[i].followerCost;
-            friendsInfluence = false;
-            rainbowInfluence = false;
-            invalidSkill = false;
-            // Check for influences that can invalidate fightresults and gather used heroes
-            for (m = 0; m < currentArmySize; m++) {
-                currentSkill = monsterReference[oldHeroArmies[i].monsters[m]].skill;
-                invalidSkill |= currentSkill.hasHeal || currentSkill.hasAsymmetricAoe;
-                friendsInfluence |= currentSkill.skillType == FRIENDS;
-                rainbowInfluence |= currentSkill.skillType == RAINBOW && currentArmySize > m + 4; // Hardcoded number of elements required to activate rainbow
-                boozeInfluence   |= currentSkill.skillType == BEER;
-                usedHeroes[oldHeroArmies[i].monsters[m]] = true;
-            }
+        const Army & army = oldHeroArmies[i];
+        if (isExpandable(army)) {
+            remainingFollowers = followerUpperBound - army.followerCost;
+            restrictMonsters(army);
 
             // Add Normal Monster. No checks needed except cost
-            for (m = 0; m < availableMonstersSize && monsterReference[availableMonsters[m]].cost <= remainingFollowers; m++) {
+            for (m = monstersBegin; m < monstersEnd && monsterReference[availableMonsters[m]].cost <= remainingFollowers; m++) {
                 // In case of a draw this could cause problems if no more suitable units are available
-                if (!removeUseless || instance.monsterUsefulLast[availableMonsters[m]] || instance.targetSize == oldHeroArmies[i].lastFightData.monstersLost) {
-                    newHeroArmies.push_back(oldHeroArmies[i]);
-                    newHeroArmies.back().add(availableMonsters[m]);
-                    newHeroArmies.back().lastFightData.valid = !instanceInvalid &&
-                                                               !friendsInfluence &&
-                                                               !rainbowInfluence &&
-                                                               !boozeInfluence &&
-                                                               !invalidSkill;
+                if (!removeUseless || instance.monsterUsefulLast[availableMonsters[m]] || instance.targetSize == army.lastFightData.monstersLost) {
+                    addChild(newHeroArmies, army, (uint32_t) i | ArmyTree::HERO_ARMY, availableMonsters[m], resumeCheck);
                 }
             }
             // Add Hero. Check if hero was used before.
             for (m = 0; m < availableHeroesSize; m++) {
-                if (!usedHeroes[availableHeroes[m]]) {
-                    if (!removeUseless || instance.monsterUsefulLast[availableHeroes[m]] || instance.targetSize == oldHeroArmies[i].lastFightData.monstersLost) {
-                        newHeroArmies.push_back(oldHeroArmies[i]);
-                        newHeroArmies.back().add(availableHeroes[m]);
-                        newHeroArmies.back().lastFightData.valid = !instanceInvalid &&
-                                                                   !monsterReference[availableHeroes[m]].skill.violatesFightResults &&
-                                                                   !rainbowInfluence &&
-                                                                   !boozeInfluence &&
-                                                                   !(monsterReference[availableHeroes[m]].skill.skillType == DAMPEN && instance.hasAoe) &&
-                                                                   !invalidSkill;
+                if (!army.hasHero(availableHeroes[m])) {
+                    if (!removeUseless || instance.monsterUsefulLast[availableHeroes[m]] || instance.targetSize == army.lastFightData.monstersLost) {
+                        addChild(newHeroArmies, army, (uint32_t) i | ArmyTree::HERO_ARMY, availableHeroes[m], resumeCheck);
                     }
                 }
-                // Clean up for the next army
-                usedHeroes[availableHeroes[m]] = false;
             }
         }
     }
 }
 
-// Takes the armies sorts them and compares them with each other. Armies that are strictly worse than other armies or have no chance of winning get dominated
-void calculateDominance(Instance & instance, bool optimizable,
-                        vector<Army> & pureMonsterArmies, vector<Army> & heroMonsterArmies,
-                        size_t armySize, size_t firstDominance) {
-    size_t i, j, si, sj;
-    size_t pureMonsterArmiesSize = pureMonsterArmies.size();
-    size_t heroMonsterArmiesSize = heroMonsterArmies.size();
+// Pack the heroes selected by mask out of heroes packed like Army::heroes into a word of the same form. Equal sets give equal words
+uint64_t selectHeroes(const uint64_t heroes, const int heroAmount, const int mask) {
+    uint64_t selected = 0;
+    int shift = 0;
+    for (int h = 0; h < heroAmount; h++) {
+        if (mask & (1 << h)) {
+            selected |= ((heroes >> (8 * h)) & 0xFF) << shift;
+            shift += 8;
+        }
+    }
+    return selected;
+}
 
-    FollowerCount leftFollowerCost;
-    FightResult * currentFightResult;
+// Count the heroes of army that are marked in breaking
+int countBreakingHeroes(const Army & army, const vector<bool> & breaking) {
+    int breakingUsed = 0;
+    for (int h = 0; h < army.heroAmount; h++) {
+        breakingUsed += breaking[army.getHero(h)];
+    }
+    return breakingUsed;
+}
 
-    // First Check dominance for non-Hero setups
-    interface.timedOutput("Calculating Dominance for non-heroes... ", DETAILED_OUTPUT, 1, firstDominance == armySize);
+// What every expansion of an army continues from, if all of them can resume the army's fight
+struct Continuation {
+    FightResult state;
+    uint64_t heroes;    // Used heroes, packed like Army::heroes
 
-    // Preselection based on the information that no monster can beat 2 monsters alone if optimizable is true
-    if (armySize == (instance.maxCombatants - 1) && optimizable) { // Must be optimizable and the last expansion
-        for (i = 0; i < pureMonsterArmiesSize; i++) {
-            pureMonsterArmies[i].lastFightData.dominated = pureMonsterArmies[i].lastFightData.monstersLost < (int) (instance.targetSize - 2);
+    bool operator==(const Continuation & other) const {
+        return this->heroes == other.heroes && isSameResumeState(this->state, other.state);
+    }
+};
+
+struct ContinuationHash {
+    size_t operator()(const Continuation & continuation) const {
+        return (size_t) hashResumeState(continuation.state, continuation.heroes);
+    }
+};
+
+// Remove armies that continue exactly like a cheaper army, or an equally expensive one before them. Returns the amount removed.
+// If no monster that can still be added breaks resuming, every expansion of an army has the outcome of the same expansion
+// of an army with the same Continuation. The kept army's expansion costs less or comes first, so no solution is lost.
+size_t mergeEquivalentArmies(ArmyTree & tree, const size_t level, const uint32_t flag, const Instance & instance) {
+    if (instance.hasWorldBoss || instance.hasGambler) {
+        return 0; // Outcomes also depend on the damage done or the seed of the army
+    }
+
+    ArmyNodeBuffer & armies = tree.getArmies(level, flag);
+    if (armies.isSpilled()) {
+        return 0; // The map of representatives could take more memory than the level has left, dominance still removes most of them
+    }
+
+    // Resuming has to stay possible up to the largest army
+    ResumeCheck resumeCheck(instance, instance.maxCombatants - 1);
+    vector<bool> breaksResuming(monsterReference.size(), false);
+    int breakingAmount = 0;
+    for (size_t h = 0; h < availableHeroes.size(); h++) {
+        if (!resumeCheck.keepsAllowing(monsterReference[availableHeroes[h]])) {
+            breaksResuming[availableHeroes[h]] = true;
+            breakingAmount++;
+        }
+    }
+
+    ArmyTreeReader reader(tree);
+    unordered_map<Continuation, size_t, ContinuationHash> representatives;
+    vector<bool> removed(armies.size(), false);
+    size_t removedAmount = 0;
+    for (size_t i = 0; i < armies.size(); i++) {
+        if (armies[i].snapshot != NO_SNAPSHOT || armies[i].followerCost >= instance.followerUpperBound) {
+            continue;
+        }
+        const Army & army = reader.get(level, (uint32_t) i | flag);
+        resumeCheck.setArmy(army);
+        if (!resumeCheck.allowsNormalMonsters()) {
+            continue;
+        }
+
+        // All heroes that break resuming must be used up already
+        if (countBreakingHeroes(army, breaksResuming) < breakingAmount) {
+            continue;
+        }
+
+        Continuation continuation;
+        continuation.state = army.lastFightData;
+        continuation.heroes = army.heroes;
+
+        auto inserted = representatives.emplace(continuation, i);
+        if (!inserted.second) {
+            size_t & representative = inserted.first->second;
+            if (army.followerCost < armies[representative].followerCost) {
+                removed[representative] = true;
+                representative = i;
+            } else {
+                removed[i] = true;
+            }
+            removedAmount++;
+        }
+    }
+
+    if (removedAmount > 0) {
+        size_t kept = 0;
+        for (size_t i = 0; i < armies.size(); i++) {
+            if (!removed[i]) {
+                armies[kept++] = armies[i];
+            }
         }
+        armies.truncate(kept);
     }
+    return removedAmount;
+}
+
+// Armies of one size a worker holds while it streams a packet
+struct StreamedArmies {
+    vector<Army> pureArmies;
+    vector<Army> heroArmies;
+    SnapshotStore snapshots;    // Snapshots of the armies' fights
+};
+
+// Buffers a worker reuses for every packet of the branchwise expansion, indexed by army size. Their size is bounded by the packet size
+struct PacketBuffers {
+    StreamedArmies sizes[ARMY_MAX_SIZE + 1];
+};
+
+// PacketBuffers of every worker. Kept between levels and instances to reuse their memory
+vector<PacketBuffers> packetBuffers;
+
+// Simulate all armies of a packet with one context.
+// All armies in a packet share the packet's position in the serial order, ties inside the packet are kept by the incumbent in order of offering
+void simulatePacket(vector<Army> & armies, uint32_t packet, Instance & instance,
+                    Incumbent & incumbent, BossFightRecord & record, FightContext & context) {
+    size_t armyAmount = armies.size();
+    if (!instance.hasWorldBoss) {
+        simulateFightRange(armies, 0, armyAmount, instance, incumbent, context, [packet] (size_t) { return packet; });
+    } else {
+        for (size_t i = 0; i < armyAmount; i++) {
+            simulateFight(armies[i], instance, context);
+            record.add(armies[i]);
+        }
+    }
+}
+
+// Bytes of config.memoryBudget left for armies next to the snapshots, the memo and the armies stored in tree. Unlimited without a budget
+size_t getFreeMemory(const ArmyTree & tree) {
+    if (config.memoryBudget == 0) {
+        return numeric_limits<size_t>::max();
+    }
+    size_t usedMemory = (config.snapshotMemory + config.memoMemory) * MEGABYTE + tree.getMemoryUsage();
+    return config.memoryBudget * MEGABYTE > usedMemory ? config.memoryBudget * MEGABYTE - usedMemory : 0;
+}
+
+// Sort the armies of a level of tree with isMoreEfficient. Their children must not be stored in tree.
+// Spilled levels stay unsorted, moving their armies in the order of the permutation would read the spill file at random
+void sortByEfficiency(ArmyTree & tree, const size_t level, const uint32_t flag) {
+    ArmyNodeBuffer & armies = tree.getArmies(level, flag);
+    if (armies.isSpilled()) {
+        return;
+    }
+    vector<int64_t> strengths(armies.size());
+    vector<uint32_t> order(armies.size());
+    ArmyTreeReader reader(tree);
+    for (size_t i = 0; i < armies.size(); i++) {
+        strengths[i] = reader.get(level, (uint32_t) i | flag).strength;
+        order[i] = (uint32_t) i;
+    }
+    sort(order.begin(), order.end(), [&] (const uint32_t a, const uint32_t b) {
+        return isMoreEfficient(armies[a].lastFightData, strengths[a], armies[b].lastFightData, strengths[b]);
+    });
+
+    // Move every army to its place in the order by following the cycles of the permutation
+    for (size_t i = 0; i < order.size(); i++) {
+        if (order[i] == i) {
+            continue;
+        }
+        ArmyNode moved = armies[i];
+        size_t k = i;
+        while (order[k] != i) {
+            armies[k] = armies[order[k]];
+            size_t next = order[k];
+            order[k] = (uint32_t) k;
+            k = next;
+        }
+        armies[k] = moved;
+        order[k] = (uint32_t) k;
+    }
+}
 
-    sort(pureMonsterArmies.begin(), pureMonsterArmies.end(), hasFewerFollowers);
-    for (i = 0; i < pureMonsterArmiesSize; i++) {
-        leftFollowerCost = pureMonsterArmies[i].followerCost;
-        currentFightResult = &pureMonsterArmies[i].lastFightData;
-        if (currentFightResult->dominated || leftFollowerCost > instance.followerUpperBound) {
-            break; // All dominated results are in the back
+// A part of a vector of armies, read like a vector of armies
+class ArmyRange {
+    public:
+        ArmyRange(const vector<Army> & someArmies, const size_t aBegin, const size_t maxAmount) :
+            armies(someArmies),
+            begin(aBegin),
+            amount(aBegin < someArmies.size() ? min(maxAmount, someArmies.size() - aBegin) : 0)
+        {}
+
+        size_t size() const {
+            return this->amount;
+        }
+        const Army & operator[](const size_t i) const {
+            return this->armies[this->begin + i];
         }
 
-        // Another pureResults got farther with a less costly lineup
-        for (j = i+1; j < pureMonsterArmiesSize; j++) {
-            if (leftFollowerCost < pureMonsterArmies[j].followerCost) {
+    private:
+        const vector<Army> & armies;
+        size_t begin;
+        size_t amount;
+};
+
+// Expands the armies of one packet depth-first up to the largest size and simulates every new army.
+// The armies of every size are expanded packetSize at a time, so a worker never holds more than the children of packetSize armies per size
+class PacketStream {
+    public:
+        PacketStream(PacketBuffers & someBuffers, const size_t aPacketSize, const uint32_t aPacket, Instance & anInstance,
+                     Incumbent & anIncumbent, BossFightRecord & aRecord, FightContext & aContext, FinalSlotIndex & aFinalSlot) :
+            buffers(someBuffers), packetSize(aPacketSize), packet(aPacket), instance(anInstance),
+            incumbent(anIncumbent), record(aRecord), context(aContext), finalSlot(aFinalSlot)
+        {}
+
+        // Expand the armies in buffers.sizes[armySize], the snapshots of their fights are in parentSnapshots
+        void expandFrom(const size_t armySize, const SnapshotStore * parentSnapshots);
+
+    private:
+        PacketBuffers & buffers;
+        size_t packetSize;
+        uint32_t packet;
+        Instance & instance;
+        Incumbent & incumbent;
+        BossFightRecord & record;
+        FightContext & context;
+        FinalSlotIndex & finalSlot;
+};
+
+void PacketStream::expandFrom(const size_t armySize, const SnapshotStore * parentSnapshots) {
+    StreamedArmies & parents = this->buffers.sizes[armySize];
+    StreamedArmies & children = this->buffers.sizes[armySize + 1];
+    const bool lastSize = armySize + 1 == this->instance.maxCombatants;
+    // Armies of the largest size are never expanded, they share one vector and take no snapshots
+    vector<Army> & heroChildren = lastSize ? children.pureArmies : children.heroArmies;
+    const size_t parentAmount = max(parents.pureArmies.size(), parents.heroArmies.size());
+
+    for (size_t begin = 0; begin < parentAmount; begin += this->packetSize) {
+        if (!this->instance.hasWorldBoss && !this->incumbent.isImprovedBy(0, this->packet)) {
+            return; // An earlier packet already found a solution for 0 followers
+        }
+        children.pureArmies.clear();
+        children.heroArmies.clear();
+        children.snapshots.clear();
+        expand(children.pureArmies, heroChildren,
+               ArmyRange(parents.pureArmies, begin, this->packetSize), ArmyRange(parents.heroArmies, begin, this->packetSize),
+               armySize, this->instance, this->incumbent.followerUpperBound(), &this->finalSlot);
+
+        this->context.snapshots = lastSize ? nullptr : &children.snapshots;
+        this->context.parentSnapshots = parentSnapshots;
+        simulatePacket(children.pureArmies, this->packet, this->instance, this->incumbent, this->record, this->context);
+        if (!lastSize) {
+            simulatePacket(children.heroArmies, this->packet, this->instance, this->incumbent, this->record, this->context);
+            this->expandFrom(armySize + 1, &children.snapshots);
+        }
+    }
+}
+
+// Armies per packet when the armies of armySize are streamed. Packets hold config.branchwiseExpansionLimit armies at most,
+// fewer if there are too few armies to give every worker PACKETS_PER_WORKER packets or if the buffers of all workers wouldn't fit into freeMemory.
+// Every worker holds the children of one packet for every size that is streamed.
+size_t getPacketSize(const size_t armyAmount, const size_t armySize, const Instance & instance, const size_t freeMemory) {
+    size_t packetSize = max((size_t) 1, config.branchwiseExpansionLimit);
+    packetSize = min(packetSize, (armyAmount + PACKETS_PER_WORKER * workerPool.size() - 1) / (PACKETS_PER_WORKER * workerPool.size()));
+    size_t fanOut = availableMonsters.size() + availableHeroes.size();
+    size_t bytesPerArmy = (instance.maxCombatants - armySize) * fanOut * sizeof(Army) * workerPool.size();
+    if (bytesPerArmy > 0) {
+        packetSize = min(packetSize, freeMemory / bytesPerArmy);
+    }
+    return max((size_t) 1, packetSize);
+}
+
+// Expand all sizes larger than armySize depth-first in packets of the armies of armySize stored in tree, to keep memory usage low.
+// Every packet is a task for the workerPool. Hero packets fan out a lot more than pure ones,
+// the pool balances this by letting idle workers steal packets from busy ones.
+// Packets are ranked by their index, so the solution is the same one a serial pass over the packets would find.
+// Once a packet found a solution for 0 followers, no later packet can improve on it and is skipped.
+void expandBranchwise(const ArmyTree & tree, const size_t armySize, Instance & instance, const size_t freeMemory) {
+    const ArmyNodeBuffer & pureMonsterArmies = tree.levels[armySize - 1].pureArmies;
+    const ArmyNodeBuffer & heroMonsterArmies = tree.levels[armySize - 1].heroArmies;
+    // The FinalSlotIndex of every worker takes its memory from the budget
+    const size_t indexMemory = FINAL_SLOT_INDEX_MEMORY * workerPool.size();
+    size_t packetSize = getPacketSize(max(pureMonsterArmies.size(), heroMonsterArmies.size()), armySize, instance,
+                                      freeMemory > indexMemory ? freeMemory - indexMemory : 0);
+    size_t packetAmount = (max(pureMonsterArmies.size(), heroMonsterArmies.size()) + packetSize - 1) / packetSize;
+
+    Incumbent incumbent(instance.followerUpperBound);
+    vector<BossFightRecord> records(instance.hasWorldBoss ? packetAmount : 0);
+    vector<PacketBuffers> & buffers = packetBuffers;
+    vector<FinalSlotIndex> finalSlots;
+    BossFightRecord unusedRecord;
+
+    for (size_t i = 0; i < buffers.size(); i++) {
+        finalSlots.emplace_back(instance, fightContexts[i]);
+    }
+
+    // The snapshots of the armies one size smaller are not needed anymore, their memory goes to the workers.
+    // Every streamed size that is expanded further takes snapshots
+    levelSnapshots[(armySize + 1) % 2].setCapacity(0);
+    size_t snapshotSizes = instance.maxCombatants - armySize - 1;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        for (size_t size = armySize + 1; size < instance.maxCombatants; size++) {
+            buffers[i].sizes[size].snapshots.setCapacity(config.snapshotMemory * MEGABYTE / 2 / buffers.size() / snapshotSizes);
+        }
+    }
+
+    workerPool.run(packetAmount, [&] (size_t worker, size_t packet) {
+        if (!instance.hasWorldBoss && !incumbent.isImprovedBy(0, (uint32_t) packet)) {
+            return; // An earlier packet already found a solution for 0 followers
+        }
+        PacketBuffers & buffer = buffers[worker];
+        BossFightRecord & record = instance.hasWorldBoss ? records[packet] : unusedRecord;
+        size_t packetBegin = packet * packetSize;
+
+        StreamedArmies & armies = buffer.sizes[armySize];
+        armies.pureArmies.clear();
+        armies.heroArmies.clear();
+        ArmyTreeReader reader(tree);
+        for (size_t k = packetBegin; k < packetBegin + packetSize; k++) {
+            if (k < pureMonsterArmies.size()) armies.pureArmies.push_back(reader.get(armySize - 1, (uint32_t) k));
+            if (k < heroMonsterArmies.size()) armies.heroArmies.push_back(reader.get(armySize - 1, (uint32_t) k | ArmyTree::HERO_ARMY));
+        }
+
+        PacketStream stream(buffer, packetSize, (uint32_t) packet, instance, incumbent, record, fightContexts[worker], finalSlots[worker]);
+        stream.expandFrom(armySize, &levelSnapshots[armySize % 2]);
+    });
+
+    if (!instance.hasWorldBoss) {
+        incumbent.applyTo(instance);
+    } else {
+        for (size_t i = 1; i < packetAmount; i++) {
+            records[0].merge(records[i]);
+        }
+        if (packetAmount > 0) {
+            records[0].applyTo(instance);
+        }
+    }
+    for (size_t i = 0; i < buffers.size(); i++) {
+        for (size_t size = 0; size <= ARMY_MAX_SIZE; size++) {
+            buffers[i].sizes[size].snapshots.setCapacity(0);
+        }
+    }
+    collectFightCounts(instance);
+    setSnapshotStores(nullptr, nullptr);
+}
+
+// Check if adding monster keeps resumed fights in order: against a front with less health left they are won at least as often.
+// Skills that depend on how many turns passed break this, killing the front sooner changes them for the rest of the fight
+bool keepsFrontHealthOrder(const Monster & monster) {
+    switch (monster.skill.skillType) {
+        case BERSERK:   // Grows with every attack
+        case TRAINING:  // Grows with every turn
+        case LUX:
+        case CRIT:      // Depend on the turn number
+        case PIERCE:
+        case VALKYRIE:
+        case TRAMPLE:   // Damage the monsters behind the front every turn
+        case REVENGE:   // Fewer deaths on the left mean less damage to the right
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Remove the available monsters that a cheaper or equally expensive one is at least as good as against the target of instance.
+// Swapping in the better monster can't turn a won fight into a lost one as long as neither the target nor any hero has skills that
+// depend on more than health and damage. Heroes whose skills depend on elements only allow swaps within an element.
+// A weaker monster could also win by surviving until TURN_LIMIT where the better one kills the front and loses to the next target monster,
+// so nothing is removed unless every army of the available units is decided before that.
+// Returns the amount of monsters removed
+size_t removeDominatedMonsters(const Instance & instance) {
+    if (instance.hasSkills || instance.hasWorldBoss) {
+        return 0;
+    }
+    vector<MonsterIndex> units(availableMonsters);
+    units.insert(units.end(), availableHeroes.begin(), availableHeroes.end());
+    FightResult start;
+    start.monstersLost = 0;
+    start.turncounter = 0;
+    if (!FightLengthBound(instance, units).endsInTime(start, instance.maxCombatants)) {
+        return 0;
+    }
+    bool sameElementOnly = false;
+    for (size_t i = 0; i < availableHeroes.size(); i++) {
+        const Monster & hero = monsterReference[availableHeroes[i]];
+        if (!keepsFrontHealthOrder(hero)) {
+            return 0;
+        }
+        switch (hero.skill.skillType) {
+            case BUFF:
+            case PROTECT:
+            case CHAMPION:
+            case BUFF_L:
+            case PROTECT_L:
+            case CHAMPION_L:
+            case RAINBOW:
+                sameElementOnly = true;
                 break;
-            } else if (*currentFightResult <= pureMonsterArmies[j].lastFightData) { // currentFightResult has more followers implicitly
-                currentFightResult->dominated = true;
+            default:
                 break;
+        }
+    }
+
+    vector<MonsterIndex> remainingMonsters;
+    for (size_t b = 0; b < availableMonsters.size(); b++) {
+        const Monster & worse = monsterReference[availableMonsters[b]];
+        bool dominated = false;
+        for (size_t a = 0; a < availableMonsters.size() && !dominated; a++) {
+            const Monster & better = monsterReference[availableMonsters[a]];
+            if (a == b || better.cost > worse.cost || (sameElementOnly && better.element != worse.element) || !isBetter(better, worse, instance.target)) {
+                continue;
             }
+            // Of two monsters that are as good as each other only the first one is kept
+            dominated = better.cost < worse.cost || !isBetter(worse, better, instance.target) || a < b;
         }
+        if (!dominated) {
+            remainingMonsters.push_back(availableMonsters[b]);
+        }
+    }
+    size_t removed = availableMonsters.size() - remainingMonsters.size();
+    availableMonsters = remainingMonsters;
+    return removed;
+}
+
+// An army taking part in dominance. Sorting puts every army behind all armies that can dominate it
+struct DominanceEntry {
+    uint64_t state;             // Resume state apart from the front's health and berserk, packed
+    int8_t berserk;
+    FollowerCount followerCost;
+    DamageType frontHealth;
+    uint32_t index;             // Index into the pure armies, or into the hero armies if ArmyTree::HERO_ARMY is set
+    bool closed;                // Every monster that can still be added resumes the fight and keeps it in order
+    int8_t heroAmount;
+    uint64_t heroes;            // Heroes of the army, packed like Army::heroes
+
+    // Pack the resume state of result apart from the front's health and berserk
+    static uint64_t packState(const FightResult & result) {
+        return ((uint64_t) (uint16_t) result.rightAoeDamage << 48) | ((uint64_t) (uint16_t) result.leftBackDamage << 32) |
+               ((uint64_t) (uint16_t) result.leftBackLethal << 16) | ((uint64_t) (uint8_t) result.monstersLost << 8) |
+               (uint64_t) (uint8_t) result.turncounter;
     }
-    // Domination for setups with heroes
-    interface.timedOutput("Calculating Dominance for heroes... ", DETAILED_OUTPUT, 1);
-    // Preselection based on the information that no monster can beat 2 monsters alone if optimizable is true
-    // Like the rest of dominance this is unreliable because an aoe hero could easily affect earlier rounds
-    if (armySize == (instance.maxCombatants - 1) && optimizable) { // Must be optimizable and the last expansion
-        for (i = 0; i < heroMonsterArmiesSize; i++) {
-            currentFightResult = &heroMonsterArmies[i].lastFightData;
 
-            currentFightResult->dominated = currentFightResult->rightAoeDamage == 0 && // make sure there is no interference to the optimized calculation
-                                            currentFightResult->monstersLost < (int) (instance.targetSize - 2); // Army left at least 2 enemies alive (this is actually checking if 3 alive)
+    // Armies can only dominate each other if they ended in the same state, which puts them into the same partition
+    static size_t getPartition(const FightResult & result, const size_t partitionAmount) {
+        return ((packState(result) ^ (uint8_t) result.berserk) * 0x9E3779B97F4A7C15ULL >> 32) % partitionAmount;
+    }
+
+    bool isSameState(const DominanceEntry & other) const {
+        return this->state == other.state && this->berserk == other.berserk;
+    }
+
+    bool operator<(const DominanceEntry & other) const {
+        if (!this->isSameState(other)) {
+            return this->state < other.state || (this->state == other.state && this->berserk < other.berserk);
+        }
+        if (this->followerCost != other.followerCost) {
+            return this->followerCost < other.followerCost;
+        }
+        if (this->frontHealth != other.frontHealth) {
+            return this->frontHealth < other.frontHealth;
+        }
+        return this->index < other.index;
+    }
+};
+
+// Remove all armies whose bit is set in dominated, armies[i] has the bit firstBit + i
+void removeDominated(ArmyNodeBuffer & armies, const vector<atomic<uint64_t>> & dominated, const size_t firstBit) {
+    size_t kept = 0;
+    for (size_t i = 0; i < armies.size(); i++) {
+        const size_t bit = firstBit + i;
+        if (((dominated[bit / 64].load(memory_order_relaxed) >> (bit % 64)) & 1) == 0) {
+            armies[kept++] = armies[i];
         }
     }
+    armies.truncate(kept);
+}
 
-    sort(heroMonsterArmies.begin(), heroMonsterArmies.end(), hasFewerFollowers);
+// Removes armies that can't lead to a cheaper solution than another army: one that costs at most as much, used a subset of its heroes
+// and ended its fight in the same state with at most as much health left on the target's front.
+// This is safe if every expansion resumes from that state and no monster that can still be added depends on the turns it took to kill the front.
+// Both armies have to pass ResumeCheck::allowsNormalMonsters, so neither holds a RAINBOW monster whose condition later slots could still complete.
+// Less front health only never hurts in fights decided before TURN_LIMIT, so both armies' fights have to end before it
+// with any monster that can still be added, which FightLengthBound checks.
+// The armies are partitioned by their state, then all workers sort and sweep the partitions. Per set of heroes the sweep keeps the lowest
+// front health seen so far, an army is dominated if any subset of its heroes has a lower or equal one.
+void calculateDominance(Instance & instance, ArmyTree & tree, const size_t level) {
+    if (instance.hasWorldBoss || instance.hasGambler) {
+        return; // Outcomes also depend on the damage done or the seed of the army
+    }
+    interface.timedOutput("Calculating Dominance... ", DETAILED_OUTPUT, 1);
+
+    // Resuming has to stay possible up to the largest army. Normal monsters have no skill and always keep the order
+    ResumeCheck resumeCheck(instance, instance.maxCombatants - 1);
+    vector<bool> breaksOrder(monsterReference.size(), false);
+    int breakingAmount = 0;
+    for (size_t h = 0; h < availableHeroes.size(); h++) {
+        const Monster & hero = monsterReference[availableHeroes[h]];
+        if (!resumeCheck.keepsAllowing(hero) || !keepsFrontHealthOrder(hero)) {
+            breaksOrder[availableHeroes[h]] = true;
+            breakingAmount++;
+        }
+    }
 
-    vector<bool> leftMonsterSet; leftMonsterSet.resize(monsterReference.size());
-    size_t leftMonsterSetSize = leftMonsterSet.size();
-    bool usedHeroSubset;
-    for (i = 0; i < leftMonsterSetSize; i++) { // prepare monsterlist
-        leftMonsterSet[i] = monsterReference[i].rarity != NO_HERO; // Normal Monsters are true by default
+    // Monsters that can still be added behind a closed army
+    vector<MonsterIndex> units(availableMonsters);
+    for (size_t h = 0; h < availableHeroes.size(); h++) {
+        if (!breaksOrder[availableHeroes[h]]) {
+            units.push_back(availableHeroes[h]);
+        }
+    }
+    const FightLengthBound fightLength(instance, units);
+    const size_t freeSlots = instance.maxCombatants - (level + 1);
+
+    // Only losing armies without snapshot that allow normal monsters and end their fight before TURN_LIMIT can dominate
+    auto isCandidate = [&] (const ArmyNode & army) {
+        return army.snapshot == NO_SNAPSHOT && army.followerCost < instance.followerUpperBound &&
+               fightLength.endsInTime(army.lastFightData, freeSlots);
+    };
+
+    // The candidates of every partition are counted first. Then the partitions are gathered and swept in batches of at most
+    // 1 / DOMINANCE_BATCHES of the candidates, unless a single partition is larger. So the entries, which are about as large as
+    // the armies, only take a fraction of the memory of the level itself.
+    // A spilled level would be read once per batch, so its entries are gathered in one pass into a spill file, one partition after another.
+    // Only if that file can't be created, the batches get smaller when needed to stay in the memory budget
+    const size_t partitionAmount = 16 * workerPool.size();
+    vector<size_t> partitionSizes(partitionAmount, 0);
+    size_t candidateAmount = 0;
+    auto countCandidates = [&] (const uint32_t flag) {
+        const ArmyNodeBuffer & armies = tree.getArmies(level, flag);
+        for (size_t i = 0; i < armies.size(); i++) {
+            if (isCandidate(armies[i])) {
+                partitionSizes[DominanceEntry::getPartition(armies[i].lastFightData, partitionAmount)]++;
+                candidateAmount++;
+            }
+        }
+    };
+    countCandidates(0);
+    countCandidates(ArmyTree::HERO_ARMY);
+
+    vector<vector<DominanceEntry>> partitions(partitionAmount);
+    DominanceEntry * spilledEntries = nullptr;
+    vector<size_t> partitionBegins(partitionAmount + 1, 0);
+    vector<size_t> partitionEnds(partitionAmount, 0); // End of the entries of every partition in spilledEntries
+    if (tree.levels[level].pureArmies.isSpilled() || tree.levels[level].heroArmies.isSpilled()) {
+        spilledEntries = (DominanceEntry *) mapSpillFile(candidateAmount * sizeof(DominanceEntry), config.spillDirectory);
+        for (size_t p = 0; p < partitionAmount; p++) {
+            partitionBegins[p + 1] = partitionBegins[p] + partitionSizes[p];
+            partitionEnds[p] = partitionBegins[p];
+        }
     }
 
-    for (i = 0; i < heroMonsterArmiesSize; i++) {
-        leftFollowerCost = heroMonsterArmies[i].followerCost;
-        currentFightResult = &heroMonsterArmies[i].lastFightData;
-        if (currentFightResult->dominated || leftFollowerCost > instance.followerUpperBound) {
-            break; // All dominated results are in the back
+    size_t batchBegin, batchEnd;
+    auto gatherEntries = [&] (const uint32_t flag) {
+        ArmyTreeReader reader(tree);
+        const ArmyNodeBuffer & armies = tree.getArmies(level, flag);
+        for (size_t i = 0; i < armies.size(); i++) {
+            if (!isCandidate(armies[i])) {
+                continue;
+            }
+            const size_t partition = DominanceEntry::getPartition(armies[i].lastFightData, partitionAmount);
+            if (partition < batchBegin || partition >= batchEnd) {
+                continue;
+            }
+            const Army & army = reader.get(level, (uint32_t) i | flag);
+            const FightResult & result = army.lastFightData;
+            resumeCheck.setArmy(army);
+            if (!resumeCheck.allowsNormalMonsters()) {
+                continue;
+            }
+
+            DominanceEntry entry;
+            entry.heroAmount = army.heroAmount;
+            entry.heroes = army.heroes;
+            entry.state = DominanceEntry::packState(result);
+            entry.berserk = result.berserk;
+            entry.followerCost = army.followerCost;
+            entry.frontHealth = result.frontHealth;
+            entry.index = (uint32_t) i | flag;
+            entry.closed = countBreakingHeroes(army, breaksOrder) == breakingAmount;
+            if (spilledEntries != nullptr) {
+                spilledEntries[partitionEnds[partition]++] = entry;
+            } else {
+                partitions[partition].push_back(entry);
+            }
+        }
+    };
+
+    // Dominated armies are marked in a bitmap with the hero armies after the pure ones. The sweeps only read the level,
+    // so a spilled level is only written when the dominated armies are removed, in order
+    const size_t pureAmount = tree.levels[level].pureArmies.size();
+    vector<atomic<uint64_t>> dominated((pureAmount + tree.levels[level].heroArmies.size()) / 64 + 1);
+    auto getBit = [pureAmount] (const uint32_t index) {
+        return (index & ArmyTree::HERO_ARMY) ? pureAmount + (index & ~ArmyTree::HERO_ARMY) : (size_t) index;
+    };
+
+    // Every army is in exactly one partition, so workers never sweep the same army
+    auto sweep = [&] (DominanceEntry * entries, const size_t entryAmount) {
+        unordered_map<uint64_t, DamageType> lowestHealths;
+
+        sort(entries, entries + entryAmount);
+        for (size_t e = 0; e < entryAmount; e++) {
+            if (e > 0 && !entries[e].isSameState(entries[e - 1])) {
+                lowestHealths.clear();
+            }
+            const uint64_t heroes = entries[e].heroes;
+            const int heroAmount = entries[e].heroAmount;
+
+            bool isDominated = false;
+            if (entries[e].closed) {
+                for (int mask = 0; mask < (1 << heroAmount) && !isDominated; mask++) {
+                    auto found = lowestHealths.find(selectHeroes(heroes, heroAmount, mask));
+                    isDominated = found != lowestHealths.end() && found->second <= entries[e].frontHealth;
+                }
+            }
+            if (isDominated) {
+                const size_t bit = getBit(entries[e].index);
+                dominated[bit / 64].fetch_or(1ULL << (bit % 64), memory_order_relaxed);
+            } else {
+                auto inserted = lowestHealths.emplace(heroes, entries[e].frontHealth);
+                inserted.first->second = min(inserted.first->second, entries[e].frontHealth);
+            }
         }
+    };
+
+    if (spilledEntries != nullptr) {
+        batchBegin = 0;
+        batchEnd = partitionAmount;
+        gatherEntries(0);
+        gatherEntries(ArmyTree::HERO_ARMY);
+        workerPool.run(partitionAmount, [&] (size_t, size_t partition) {
+            sweep(spilledEntries + partitionBegins[partition], partitionEnds[partition] - partitionBegins[partition]);
+        });
+        unmapSpillFile(spilledEntries, candidateAmount * sizeof(DominanceEntry));
+    } else {
+        const size_t batchLimit = max(min(candidateAmount / DOMINANCE_BATCHES, getFreeMemory(tree) / sizeof(DominanceEntry)), (size_t) 1);
+        for (batchBegin = 0; batchBegin < partitionAmount; batchBegin = batchEnd) {
+            size_t batchSize = 0;
+            batchEnd = batchBegin;
+            do {
+                batchSize += partitionSizes[batchEnd];
+                partitions[batchEnd].reserve(partitionSizes[batchEnd]);
+                batchEnd++;
+            } while (batchEnd < partitionAmount && batchSize + partitionSizes[batchEnd] <= batchLimit);
+            gatherEntries(0);
+            gatherEntries(ArmyTree::HERO_ARMY);
+
+            workerPool.run(batchEnd - batchBegin, [&] (size_t, size_t batchPartition) {
+                vector<DominanceEntry> & entries = partitions[batchBegin + batchPartition];
+                sweep(entries.data(), entries.size());
+                vector<DominanceEntry>().swap(entries); // The memory goes to the next batch
+            });
+        }
+    }
 
-        for (si = 0; si < armySize; si++) {
-            leftMonsterSet[heroMonsterArmies[i].monsters[si]] = true; // Add lefts monsters to set
+    removeDominated(tree.levels[level].pureArmies, dominated, 0);
+    removeDominated(tree.levels[level].heroArmies, dominated, pureAmount);
+}
+
+// A unit waiting to be added to a stored army by the cost ordered search
+struct CostOrderedStep {
+    FollowerCount followerCost; // Cost of the army with the unit added
+    uint32_t parent;            // Index of the army in the stored armies
+    uint32_t unit;              // Position of the unit in the list of units ordered by cost
+
+    // Cheapest steps first. Ties go to older armies, so shorter armies of the same cost come first
+    bool operator>(const CostOrderedStep & other) const {
+        return tie(this->followerCost, this->parent, this->unit) > tie(other.followerCost, other.parent, other.unit);
+    }
+};
+
+// Search armies in order of their follower cost instead of their size. The first army that wins is the cheapest solution.
+// Every stored army tries its units one after another, cheapest first: after a unit is tried, the next one for the same army is queued.
+// So each step only queues steps that cost at least as much, and armies leave the queue in order of cost.
+// Armies continuing exactly like a stored army of at most their size are not stored, the stored army is as cheap and has room for the same units.
+// Like merging, this needs every expansion of both armies to resume, which ResumeCheck::allowsNormalMonsters ensures up to the largest army.
+// Returns true if the search finished: either a solution was found or no army below followerUpperBound wins.
+// Returns false if it ran out of config.costOrderedMemory first, instance is unchanged then.
+bool solveByCost(Instance & instance) {
+    const size_t memoryLimit = config.costOrderedMemory * MEGABYTE;
+    const FollowerCount followerUpperBound = instance.followerUpperBound;
+    FightContext & context = fightContexts[0];
+
+    // Heroes and monsters in order of their cost
+    vector<MonsterIndex> units(availableHeroes);
+    units.insert(units.end(), availableMonsters.begin(), availableMonsters.end());
+    stable_sort(units.begin(), units.end(), [] (MonsterIndex a, MonsterIndex b) {
+        return monsterReference[a].cost < monsterReference[b].cost;
+    });
+
+    // The same conditions as for merging equivalent armies, with all army sizes kept apart
+    bool merging = !instance.hasGambler;
+    ResumeCheck finalCheck(instance, instance.maxCombatants - 1);
+    vector<bool> breaksResuming(monsterReference.size(), false);
+    int breakingAmount = 0;
+    for (size_t h = 0; h < availableHeroes.size(); h++) {
+        if (!finalCheck.keepsAllowing(monsterReference[availableHeroes[h]])) {
+            breaksResuming[availableHeroes[h]] = true;
+            breakingAmount++;
+        }
+    }
+    vector<unordered_set<Continuation, ContinuationHash>> continuations(instance.maxCombatants);
+    const size_t CONTINUATION_MEMORY = sizeof(Continuation) + 2 * sizeof(void *); // Including the node and bucket of the set
+    size_t continuationAmount = 0;
+
+    vector<Army> armies(1); // Starts with the empty army
+    priority_queue<CostOrderedStep, vector<CostOrderedStep>, greater<CostOrderedStep>> steps;
+
+    // Queue the first unit from position on that can be added to the army
+    auto queueStep = [&] (const uint32_t parent, uint32_t unit) {
+        const Army & army = armies[parent];
+        for (; unit < units.size(); unit++) {
+            if (monsterReference[units[unit]].cost >= followerUpperBound - army.followerCost) {
+                return; // All further units are too expensive as well
+            }
+            if (monsterReference[units[unit]].rarity == NO_HERO || !army.hasHero(units[unit])) {
+                steps.push({army.followerCost + monsterReference[units[unit]].cost, parent, unit});
+                return;
+            }
+        }
+    };
+
+    interface.timedOutput("Searching Lineups in order of their cost... ", DETAILED_OUTPUT, 1, true);
+    setSnapshotStores(nullptr, nullptr); // Stored armies of all sizes are expanded at the same time
+    queueStep(0, 0);
+    while (!steps.empty()) {
+        if (armies.size() * sizeof(Army) + steps.size() * sizeof(CostOrderedStep) + continuationAmount * CONTINUATION_MEMORY > memoryLimit) {
+            interface.outputMessage("Cost ordered search ran out of memory at " + to_string(steps.top().followerCost) + " followers.", DETAILED_OUTPUT, 1);
+            collectFightCounts(instance);
+            return false;
+        }
+        const CostOrderedStep step = steps.top();
+        steps.pop();
+        queueStep(step.parent, step.unit + 1);
+
+        const Army & parent = armies[step.parent];
+        const MonsterIndex unit = units[step.unit];
+        if (parent.monsterAmount > 0 && parent.monsterAmount + 1 == (int) instance.maxCombatants && !instance.monsterUsefulLast[unit] &&
+            parent.lastFightData.monstersLost != (int) instance.targetSize) {
+            continue; // Can't win in the last slot
+        }
+        Army army = parent;
+        ResumeCheck resumeCheck(instance, parent.monsterAmount);
+        resumeCheck.setArmy(parent);
+        army.add(unit);
+        army.lastFightData.valid = parent.monsterAmount > 0 && resumeCheck.allows(monsterReference[unit]);
+
+        if (simulateFight(army, instance, context)) {
+            instance.bestSolution = army;
+            instance.followerUpperBound = army.followerCost;
+            interface.outputMessage("Found the cheapest solution after " + to_string(armies.size()) + " Lineups:", DETAILED_OUTPUT, 1);
+            interface.outputMessage(army.toString(), DETAILED_OUTPUT, 2);
+            collectFightCounts(instance);
+            return true;
+        }
+        if (army.monsterAmount == (int) instance.maxCombatants) {
+            continue;
         }
 
-        // Proper dominance check
-        if (!currentFightResult->dominated) {
-            // if i costs more followers and got less far than j, then i is dominated
-            for (j = i+1; j < heroMonsterArmiesSize; j++) {
-                if (leftFollowerCost < heroMonsterArmies[j].followerCost) {
-                    break;
-                } else if (*currentFightResult <= heroMonsterArmies[j].lastFightData) { // i has more followers implicitly
-                    usedHeroSubset = true; // If j doesn't use a strict subset of the heroes i used, it cannot dominate i
-                    for (sj = 0; sj < armySize; sj++) { // for every hero in j there must be the same hero in i
-                        if (!leftMonsterSet[heroMonsterArmies[j].monsters[sj]]) {
-                            usedHeroSubset = false;
-                            break;
-                        }
-                    }
-                    if (usedHeroSubset) {
-                        // even with a strict subset, order is important, so pruning a solution can result in failure to find any solution
-                        currentFightResult->dominated = true;
-                        break;
-                    }
+        finalCheck.setArmy(army);
+        if (merging && army.snapshot == NO_SNAPSHOT && finalCheck.allowsNormalMonsters()) {
+            if (countBreakingHeroes(army, breaksResuming) == breakingAmount) {
+                Continuation continuation;
+                continuation.state = army.lastFightData;
+                continuation.heroes = army.heroes;
+                bool known = false;
+                for (int size = 1; size <= army.monsterAmount && !known; size++) {
+                    known = continuations[size].count(continuation) > 0;
+                }
+                if (known) {
+                    continue;
                 }
+                continuations[army.monsterAmount].insert(continuation);
+                continuationAmount++;
             }
         }
-        // Clean up monster set for next iteration
-        for (si = 0; si < armySize; si++) {
-            leftMonsterSet[heroMonsterArmies[i].monsters[si]] = monsterReference[heroMonsterArmies[i].monsters[si]].rarity == NO_HERO; // Remove only heroes from the set
+        if (completionBound.prunes(army, finalCheck, instance.maxCombatants - army.monsterAmount, followerUpperBound)) {
+            continue;
         }
+        armies.push_back(army);
+        queueStep((uint32_t) armies.size() - 1, 0);
     }
+    interface.outputMessage("No Lineup below the follower limit wins.", DETAILED_OUTPUT, 1);
+    collectFightCounts(instance);
+    return true;
 }
 
 // Use a greedy method to get a first upper bound on follower cost for the solution
@@ -309,7 +1739,6 @@ void getQuickSolutions(Instance & instance) {
 
 // Main method for solving an instance.
 void solveInstance(Instance & instance, size_t firstDominance) {
-    Army tempArmy;
     time_t startTime;
     size_t i;
 
@@ -318,53 +1747,83 @@ void solveInstance(Instance & instance, size_t firstDominance) {
 //        getQuickSolutions(instance);
 //    }
 
-    // Fill two vectors with armies each containing exactly one unique available hero or monster
-    vector<Army> pureMonsterArmies;
-    vector<Army> heroMonsterArmies;
+    // Fill the first level with armies each containing exactly one unique available hero or monster
+    ArmyTree tree;
+    tree.levels.reserve(instance.maxCombatants);
+    tree.levels.emplace_back();
+    ArmyNodeBuffer & pureMonsterArmies = tree.levels[0].pureArmies;
+    ArmyNodeBuffer & heroMonsterArmies = tree.levels[0].heroArmies;
+    pureMonsterArmies.reserve(availableMonsters.size());
+    heroMonsterArmies.reserve(availableHeroes.size());
+    auto addFirstArmy = [] (ArmyNodeBuffer & armies, const MonsterIndex monster) {
+        armies.emplace_back();
+        armies.back().followerCost = monsterReference[monster].cost;
+        armies.back().parent = ArmyTree::NO_PARENT;
+        armies.back().snapshot = NO_SNAPSHOT;
+        armies.back().monster = monster;
+    };
     for (i = 0; i < availableMonsters.size(); i++) {
         if (monsterReference[availableMonsters[i]].cost <= instance.followerUpperBound) {
-            pureMonsterArmies.push_back(Army( {availableMonsters[i]} ));
+            addFirstArmy(pureMonsterArmies, availableMonsters[i]);
         }
     }
     for (i = 0; i < availableHeroes.size(); i++) { // Ignore checking for Hero Cost
-        heroMonsterArmies.push_back(Army( {availableHeroes[i]} ));
+        addFirstArmy(heroMonsterArmies, availableHeroes[i]);
     }
 
-    // Check if a single monster can beat the last two monsters of the target. If not, solutions that can only beat n-2 monsters need not be expanded later
-//    bool optimizable = (instance.targetSize > ARMY_MAX_BRUTEFORCEABLE_SIZE && instance.targetSize > 3);
-//    if (optimizable) {
-//        tempArmy = Army({instance.target.monsters[instance.targetSize - 2], instance.target.monsters[instance.targetSize - 1]}); // Make an army from the last two monsters
-//    }
-//    if (optimizable) { // Check with normal Mobs
-//        for (i = 0; i < pureMonsterArmies.size(); i++) {
-//            if (simulateFight(pureMonsterArmies[i], tempArmy)) { // Monster won the fight
-//                optimizable = false;
-//                break;
-//            }
-//        }
-//    }
-//    if (optimizable) { // Check with Heroes
-//        for (i = 0; i < heroMonsterArmies.size(); i++) {
-//            if (simulateFight(heroMonsterArmies[i], tempArmy)) { // Hero won the fight
-//                optimizable = false;
-//                break;
-//            }
-//        }
-//    }
+    // Pick the fight kernel that only handles the skills present on either side
+    instance.fightFeatures = 0;
+    for (i = 0; i < (size_t) instance.target.monsterAmount; i++) {
+        instance.fightFeatures |= getFightFeatures(monsterReference[instance.target.monsters[i]]);
+    }
+    for (i = 0; i < pureMonsterArmies.size(); i++) {
+        instance.fightFeatures |= getFightFeatures(monsterReference[pureMonsterArmies[i].monster]);
+    }
+    for (i = 0; i < heroMonsterArmies.size(); i++) {
+        instance.fightFeatures |= getFightFeatures(monsterReference[heroMonsterArmies[i].monster]);
+    }
+
+    // Split the memory for snapshots between the two army sizes alive at the same time
+    levelSnapshots[0].setCapacity(config.snapshotMemory * MEGABYTE / 2);
+    levelSnapshots[1].setCapacity(config.snapshotMemory * MEGABYTE / 2);
+
+    // Outcomes only carry over between armies if the target doesn't depend on their seed
+    suffixMemo.setCapacity(config.memoMemory * MEGABYTE);
+    suffixMemo.clear();
+    for (i = 0; i < fightContexts.size(); i++) {
+        fightContexts[i].memo = suffixMemo.isEnabled() && !instance.hasGambler ? &suffixMemo : nullptr;
+    }
+    // Armies whose free slots can't beat the rest of the target below the follower limit are never expanded
+    completionBound.compute(instance, fightContexts[0]);
 
     // Run the Bruteforce Loop
     startTime = time(NULL);
+
+    // Searching in order of cost makes the first solution the cheapest. The level search only runs if that search runs out of memory
+    if (config.costOrderedMemory > 0 && !instance.hasWorldBoss && solveByCost(instance)) {
+        interface.finishTimedOutput(DETAILED_OUTPUT);
+        instance.calculationTime = time(NULL) - startTime;
+        return;
+    }
     for (size_t armySize = 1; armySize <= instance.maxCombatants; armySize++) {
+        const size_t level = armySize - 1;
         // Output Debug Information
         interface.outputMessage("Starting loop for armies of size " + to_string(armySize), BASIC_OUTPUT);
 
+        // The snapshots of armies two sizes smaller are not needed anymore. Armies of the largest size are never expanded
+        SnapshotStore * snapshots = armySize < instance.maxCombatants ? &levelSnapshots[armySize % 2] : nullptr;
+        if (snapshots != nullptr) {
+            snapshots->clear();
+        }
+        setSnapshotStores(snapshots, &levelSnapshots[(armySize + 1) % 2]);
+
         // Run Fights for non-Hero setups
-        interface.timedOutput("Simulating " + to_string(pureMonsterArmies.size()) + " non-hero Fights... ", DETAILED_OUTPUT, 1, true);
-        simulateMultipleFights(pureMonsterArmies, instance);
+        interface.timedOutput("Simulating " + to_string(tree.levels[level].pureArmies.size()) + " non-hero Fights... ", DETAILED_OUTPUT, 1, true);
+        simulateMultipleFights(tree, level, 0, instance);
 
         // Run fights for setups with heroes
-        interface.timedOutput("Simulating " + to_string(heroMonsterArmies.size()) + " hero Fights... ", DETAILED_OUTPUT, 1);
-        simulateMultipleFights(heroMonsterArmies, instance);
+        interface.timedOutput("Simulating " + to_string(tree.levels[level].heroArmies.size()) + " hero Fights... ", DETAILED_OUTPUT, 1);
+        simulateMultipleFights(tree, level, ArmyTree::HERO_ARMY, instance);
 
         // If we have a valid solution with 0 followers there is no need to continue
         if (!instance.hasWorldBoss && instance.bestSolution.monsterAmount > 0 && instance.bestSolution.followerCost == 0) { break; }
@@ -392,27 +1851,60 @@ void solveInstance(Instance & instance, size_t firstDominance) {
                 if (!iomanager.askYesNoQuestion("Continue calculation?", DETAILED_OUTPUT, TOKENS.YES)) {return;}
                 startTime = time(NULL);
                 interface.outputMessage("\nPreparing to work on loop for armies of size " + to_string(armySize+1), DETAILED_OUTPUT);
-                interface.outputMessage("Currently considering " + to_string(pureMonsterArmies.size()) + " normal and " + to_string(heroMonsterArmies.size()) + " hero armies.", DETAILED_OUTPUT);
+                interface.outputMessage("Currently considering " + to_string(tree.levels[level].pureArmies.size()) + " normal and " + to_string(tree.levels[level].heroArmies.size()) + " hero armies.", DETAILED_OUTPUT);
             }
 
-            // Calculate which results are strictly better than others (dominance)
-            // Reduces memory, but increases calculation time and can result in completely missing a correct solution
-//            if (firstDominance <= armySize && availableMonsters.size() > 0) {
-//                calculateDominance(instance, optimizable, pureMonsterArmies, heroMonsterArmies, armySize, firstDominance);
-//            }
+            // Armies that continue exactly like cheaper ones need not be expanded
+            interface.timedOutput("Merging equivalent Lineups... ", DETAILED_OUTPUT, 1, firstDominance == armySize);
+            mergeEquivalentArmies(tree, level, 0, instance);
+            mergeEquivalentArmies(tree, level, ArmyTree::HERO_ARMY, instance);
 
-            if (armySize < instance.maxCombatants - 2) {
+            // Remove armies that can't lead to a cheaper solution than others (dominance). Saves memory and time from firstDominance on
+            if (firstDominance <= armySize) {
+                calculateDominance(instance, tree, level);
+            }
+
+            // The next size is stored as long as it fits into the memory budget or a spill file. After that all larger sizes are streamed
+            bool storeNextLevel = armySize + 2 < instance.maxCombatants;
+            if (storeNextLevel) {
                 // now we expand to add the next monster to all non-dominated armies
                 interface.timedOutput("Expanding Lineups by one... ", DETAILED_OUTPUT, 1);
-                vector<Army> nextPureArmies;
-                vector<Army> nextHeroArmies;
-                expand(nextPureArmies, nextHeroArmies, pureMonsterArmies, heroMonsterArmies, armySize, instance);
-
-                interface.timedOutput("Moving Data... ", DETAILED_OUTPUT, 1);
-                pureMonsterArmies = move(nextPureArmies);
-                heroMonsterArmies = move(nextHeroArmies);
+                ArmyTreeReader reader(tree);
+                ArmyLevelView pureArmies(reader, tree, level, 0);
+                ArmyLevelView heroArmies(reader, tree, level, ArmyTree::HERO_ARMY);
+                // Count the children first, growing the level while it is filled would copy it and leave up to half of it unused
+                ChildCounter pureChildren;
+                ChildCounter heroChildren;
+                expand(pureChildren, heroChildren, pureArmies, heroArmies, armySize, instance, instance.followerUpperBound);
+                // Dominance needs memory for a batch of entries on top of the level
+                size_t levelMemory = (pureChildren.amount + heroChildren.amount) * (sizeof(ArmyNode) + sizeof(DominanceEntry) / DOMINANCE_BATCHES);
+                const string levelDescription = "the " + to_string(pureChildren.amount + heroChildren.amount) + " armies of size " + to_string(armySize + 1);
+                bool spillNextLevel = false;
+                if (levelMemory > getFreeMemory(tree) && !config.spillDirectory.empty()) {
+                    // Spilled levels keep their dominance entries in a spill file as well
+                    tree.levels.emplace_back();
+                    spillNextLevel = tree.levels.back().pureArmies.reserveSpilled(pureChildren.amount, config.spillDirectory) &&
+                                     tree.levels.back().heroArmies.reserveSpilled(heroChildren.amount, config.spillDirectory);
+                    if (spillNextLevel) {
+                        interface.outputMessage("Storing " + levelDescription + " in spill files in " + config.spillDirectory + ".", BASIC_OUTPUT);
+                    } else {
+                        tree.levels.pop_back();
+                        interface.outputMessage("Could not create spill files in " + config.spillDirectory + ".", BASIC_OUTPUT);
+                    }
+                }
+                if (levelMemory > getFreeMemory(tree) && !spillNextLevel) {
+                    interface.outputMessage("Storing " + levelDescription + " would exceed the memory budget, expanding depth-first from here on.", BASIC_OUTPUT);
+                    storeNextLevel = false;
+                } else {
+                    if (!spillNextLevel) {
+                        tree.levels.emplace_back();
+                        tree.levels.back().pureArmies.reserve(pureChildren.amount);
+                        tree.levels.back().heroArmies.reserve(heroChildren.amount);
+                    }
+                    expand(tree.levels.back().pureArmies, tree.levels.back().heroArmies, pureArmies, heroArmies, armySize, instance, instance.followerUpperBound);
+                }
             }
-            else {
+            if (!storeNextLevel) {
                 // for the second to last expansion, expand and fight each lineups individually (or in small packets) to keep memory usage low
                 // some max length solutions will therefore be seen before other solutions of one lower size
                 // TODO: refactor this to get rid of code repetition someday
@@ -420,22 +1912,9 @@ void solveInstance(Instance & instance, size_t firstDominance) {
                 interface.outputMessage("Starting loop for armies of size " + to_string(armySize + 1) + "+", BASIC_OUTPUT);
                 interface.timedOutput("Simulating fights by expanding Lineups one by one ...", DETAILED_OUTPUT, 1, true);
 
-                sort(pureMonsterArmies.begin(), pureMonsterArmies.end(), isMoreEfficient);
-                sort(heroMonsterArmies.begin(), heroMonsterArmies.end(), isMoreEfficient);
-                for (size_t i = 0, j = 0; i < pureMonsterArmies.size() || j < heroMonsterArmies.size(); ) {
-                    vector<Army> tempArmies, pureBranchArmies, heroBranchArmies, pureBranchArmies2, heroBranchArmies2;
-                    for (size_t k = 0; k < config.branchwiseExpansionLimit; ++k) {
-                        if (i < pureMonsterArmies.size()) pureBranchArmies.push_back(pureMonsterArmies[i++]);
-                        if (j < heroMonsterArmies.size()) heroBranchArmies.push_back(heroMonsterArmies[j++]);
-                    }
-                    expand(pureBranchArmies2, heroBranchArmies2, pureBranchArmies, heroBranchArmies, armySize, instance);
-                    simulateMultipleFights(pureBranchArmies2, instance);
-                    simulateMultipleFights(heroBranchArmies2, instance);
-                    if (!instance.hasWorldBoss && instance.bestSolution.monsterAmount > 0 && instance.bestSolution.followerCost == 0) break;
-                    expand(tempArmies, tempArmies, pureBranchArmies2, heroBranchArmies2, armySize + 1, instance);
-                    simulateMultipleFights(tempArmies, instance);
-                    if (!instance.hasWorldBoss && instance.bestSolution.monsterAmount > 0 && instance.bestSolution.followerCost == 0) break;
-                }
+                sortByEfficiency(tree, level, 0);
+                sortByEfficiency(tree, level, ArmyTree::HERO_ARMY);
+                expandBranchwise(tree, armySize, instance, getFreeMemory(tree));
 
                 interface.finishTimedOutput(DETAILED_OUTPUT);
                 break;
@@ -489,8 +1968,26 @@ int main(int argc, char** argv) {
     interface.outputMessage("", NOTIFICATION_OUTPUT);
     iomanager.getConfiguration();
 
+    // Flags after the input file override the configuration
+    for (int i = 2; i < argc; i++) {
+        if ((string) argv[i] == "-memory" && i + 1 < argc) {
+            try {
+                config.memoryBudget = (size_t) max((int64_t) 0, parseInt(argv[++i]));
+            } catch (const invalid_argument &e) {
+                interface.outputMessage((string) (e.what()) + " Ignoring flag '-memory'!", NOTIFICATION_OUTPUT);
+            }
+        }
+        if ((string) argv[i] == "-spill" && i + 1 < argc) {
+            config.spillDirectory = argv[++i];
+        }
+    }
+
     // Initialize global Data
     initGameData();
+    workerPool.start(config.threads);
+    fightContexts.resize(workerPool.size());
+    fightChunks.resize(workerPool.size());
+    packetBuffers = vector<PacketBuffers>(workerPool.size());
 
     // -------------------------------------------- Program Start --------------------------------------------
 
@@ -546,7 +2043,15 @@ int main(int argc, char** argv) {
 
             instances[i].followerUpperBound = userFollowerUpperBound;
 
+            // Monsters that are never better than cheaper ones against this target are left out while solving it
+            vector<MonsterIndex> allMonsters = availableMonsters;
+            size_t dominatedMonsters = removeDominatedMonsters(instances[i]);
+            if (dominatedMonsters > 0) {
+                interface.outputMessage("Left out " + to_string(dominatedMonsters) + " Monsters that are no better than cheaper ones against this target.", BASIC_OUTPUT);
+            }
+
             solveInstance(instances[i], config.firstDominance);
+            availableMonsters = allMonsters;
             outputSolution(instances[i]);
         }
         userWantsContinue = iomanager.askYesNoQuestion("Do you want to calculate more lineups?", NOTIFICATION_OUTPUT, TOKENS.NO);
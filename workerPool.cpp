@@ -0,0 +1,137 @@
+#include "workerPool.h"
+
+WorkerPool workerPool;
+
+WorkerPool::~WorkerPool() {
+    this->stop();
+}
+
+// Create threadCount-1 threads, the calling thread of run() is the last worker
+void WorkerPool::start(size_t threadCount) {
+    this->stop();
+    if (threadCount == 0) {
+        threadCount = std::thread::hardware_concurrency();
+    }
+    if (threadCount == 0) {
+        threadCount = 1;
+    }
+    this->shuttingDown = false;
+    this->queues.clear();
+    for (size_t i = 0; i < threadCount; i++) {
+        this->queues.emplace_back(new TaskRange());
+    }
+    for (size_t i = 1; i < threadCount; i++) {
+        this->threads.emplace_back(&WorkerPool::workerLoop, this, i);
+    }
+}
+
+void WorkerPool::stop() {
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->shuttingDown = true;
+    }
+    this->wakeUp.notify_all();
+    for (size_t i = 0; i < this->threads.size(); i++) {
+        this->threads[i].join();
+    }
+    this->threads.clear();
+}
+
+size_t WorkerPool::size() const {
+    return this->threads.size() + 1;
+}
+
+// Idle loop of the pool's threads. Sleeps until run() publishes a new generation of tasks
+void WorkerPool::workerLoop(size_t workerId) {
+    size_t seenGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->wakeUp.wait(guard, [&] { return this->shuttingDown || this->generation != seenGeneration; });
+            if (this->shuttingDown) {
+                return;
+            }
+            seenGeneration = this->generation;
+        }
+        this->processTasks(workerId);
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->activeWorkers--;
+        }
+        this->finished.notify_one();
+    }
+}
+
+// Work on the own queue and steal from others until no tasks are left anywhere
+void WorkerPool::processTasks(size_t workerId) {
+    size_t task;
+    do {
+        while (this->takeTask(workerId, task)) {
+            (*this->currentTask)(workerId, task);
+        }
+    } while (this->stealTasks(workerId));
+}
+
+// Take the next task from the front of the own queue
+bool WorkerPool::takeTask(size_t workerId, size_t & task) {
+    TaskRange & own = *this->queues[workerId];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (own.begin >= own.end) {
+        return false;
+    }
+    task = own.begin++;
+    return true;
+}
+
+// Move the back half of another worker's queue into the own queue. Returns false if every queue is empty
+bool WorkerPool::stealTasks(size_t workerId) {
+    size_t workerAmount = this->queues.size();
+    for (size_t i = 1; i < workerAmount; i++) {
+        TaskRange & victim = *this->queues[(workerId + i) % workerAmount];
+        size_t begin, end;
+        {
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (victim.begin >= victim.end) {
+                continue;
+            }
+            end = victim.end;
+            begin = victim.end - (victim.end - victim.begin + 1) / 2;
+            victim.end = begin;
+        }
+        TaskRange & own = *this->queues[workerId];
+        std::lock_guard<std::mutex> guard(own.lock);
+        own.begin = begin;
+        own.end = end;
+        return true;
+    }
+    return false;
+}
+
+void WorkerPool::run(size_t amount, const WorkerTask & task) {
+    if (this->threads.empty() || amount <= 1) {
+        for (size_t i = 0; i < amount; i++) {
+            task(0, i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        size_t workerAmount = this->queues.size();
+        for (size_t i = 0; i < workerAmount; i++) {
+            std::lock_guard<std::mutex> queueGuard(this->queues[i]->lock);
+            this->queues[i]->begin = amount * i / workerAmount;
+            this->queues[i]->end = amount * (i + 1) / workerAmount;
+        }
+        this->currentTask = &task;
+        this->activeWorkers = this->threads.size();
+        this->generation++;
+    }
+    this->wakeUp.notify_all();
+
+    this->processTasks(0);
+
+    std::unique_lock<std::mutex> guard(this->lock);
+    this->finished.wait(guard, [&] { return this->activeWorkers == 0; });
+    this->currentTask = nullptr;
+}
@@ -0,0 +1,60 @@
+#ifndef WORKER_POOL_HEADER
+#define WORKER_POOL_HEADER
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+// Function executed for every task. Gets the id of the worker running it and the index of the task
+using WorkerTask = std::function<void(size_t, size_t)>;
+
+// Tasks a worker still has to do. The owner takes tasks from the front, other workers steal from the back
+struct TaskRange {
+    std::mutex lock;
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+// A fixed set of threads that work through numbered tasks together.
+// The thread calling run() takes part as worker 0, so a pool of size 1 runs everything on the calling thread.
+// Worker ids are always smaller than size() and can be used to index per thread data like FightContexts.
+//
+// Tasks are split into one consecutive block per worker. Every worker processes its own block in order
+// and steals half of the remaining block of another worker once it runs out. Tasks of very different cost
+// stay balanced this way while workers mostly touch their own queue and neighbouring tasks.
+class WorkerPool {
+    private:
+        std::vector<std::thread> threads;
+        std::vector<std::unique_ptr<TaskRange>> queues;
+        std::mutex lock;
+        std::condition_variable wakeUp;
+        std::condition_variable finished;
+
+        const WorkerTask * currentTask = nullptr;
+        size_t generation = 0;      // Incremented for every call of run(), wakes up the threads
+        size_t activeWorkers = 0;   // Threads still working on the current generation
+        bool shuttingDown = false;
+
+        void workerLoop(size_t workerId);
+        void processTasks(size_t workerId);
+        bool takeTask(size_t workerId, size_t & task);
+        bool stealTasks(size_t workerId);
+
+    public:
+        ~WorkerPool();
+
+        // (Re)create the threads. 0 uses all available cores
+        void start(size_t threadCount);
+        void stop();
+        size_t size() const;
+
+        // Calls task(workerId, taskIndex) for every taskIndex in [0, amount) and returns when all of them are done
+        void run(size_t amount, const WorkerTask & task);
+};
+
+extern WorkerPool workerPool;
+
+#endif